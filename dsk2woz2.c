@@ -12,213 +12,4618 @@
 //
 //
 
+// POSIX.1-2008 (for getaddrinfo, realpath and posix_memalign) even under a strict -std=c11,
+// and on Linux the GNU extensions too, which is where O_DIRECT lives.
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <dirent.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "dsk2woz2.h"
 
 //
 // Helpful constants and types
 //
 
-#define CREATOR_NAME        "dsk2woz2"
+// The geometry and sizes from dsk2woz2.h, by the shorter names used throughout.
+#define TRACKS_PER_DISK              DSK2WOZ2_TRACKS_PER_DISK
+#define SECTORS_PER_TRACK            DSK2WOZ2_SECTORS_PER_TRACK
+#define BYTES_PER_SECTOR             DSK2WOZ2_BYTES_PER_SECTOR
+#define BYTES_PER_TRACK              DSK2WOZ2_BYTES_PER_TRACK
+#define DSK_IMAGE_SIZE               DSK2WOZ2_DSK_IMAGE_SIZE
+#define NIB_TRACK_SIZE               DSK2WOZ2_NIB_TRACK_SIZE
+#define NIB_IMAGE_SIZE               DSK2WOZ2_NIB_IMAGE_SIZE
+#define BITS_BLOCKS_PER_TRACK        DSK2WOZ2_BITS_BLOCKS_PER_TRACK
+#define BITS_BLOCK_SIZE              DSK2WOZ2_BITS_BLOCK_SIZE
+#define BITS_TRACK_SIZE              DSK2WOZ2_BITS_TRACK_SIZE
+#define WOZ_HEADER_SIZE              DSK2WOZ2_WOZ_HEADER_SIZE
+#define WOZ_INFO_CHUNK_SIZE          DSK2WOZ2_WOZ_INFO_CHUNK_SIZE
+#define WOZ_TMAP_CHUNK_SIZE          DSK2WOZ2_WOZ_TMAP_CHUNK_SIZE
+#define WOZ_TRKS_CHUNK_SIZE          DSK2WOZ2_WOZ_TRKS_CHUNK_SIZE
+#define WOZ_WRIT_CHUNK_SIZE          DSK2WOZ2_WOZ_WRIT_CHUNK_SIZE
+#define WOZ_IMAGE_SIZE               DSK2WOZ2_WOZ_IMAGE_SIZE
+#define HFE_BLOCK_SIZE               DSK2WOZ2_HFE_BLOCK_SIZE
+#define HFE_BIT_RATE                 DSK2WOZ2_HFE_BIT_RATE
+#define HFE_RPM                      DSK2WOZ2_HFE_RPM
+#define HFE_EMPTY_TRACK_BITS         DSK2WOZ2_HFE_EMPTY_TRACK_BITS
+
+#define CREATOR_NAME        "dsk2woz2"
+
+#define WOZ1_TRACK_SIZE     6656
+#define WOZ1_BITSTREAM_SIZE 6646
+
+#define BITS_SECTOR_CONTENTS_SIZE   343
+
+#define DOS_VOLUME_NUMBER           254
+#define DOS_CATALOG_TRACK           17
+#define TRACK_LEADER_SYNC_COUNT     64
+
+#define LEASE_MAX_JOBS              64
+#define LEASE_TIMEOUT_SECONDS       60
+#define WORKER_WAIT_SECONDS         1
+
+//
+// Forward declarations for utility routines
+//
+
+// Fills in a track's BITS from the source image, returning the number of valid bits.
+typedef uint32_t (* track_filler)(uint8_t * bits, const uint8_t * source, int track_number,
+                                  const dsk2woz2_options * options);
+
+static void write_woz_header(uint8_t * woz);
+static size_t assemble_woz(uint8_t * woz, const uint8_t * source, track_filler fill_track,
+                           int cleaned, int boot_sector_format, int include_writ,
+                           const dsk2woz2_options * options);
+static uint32_t encode_dsk_track(uint8_t * bits, const uint8_t * dsk, int track_number, const dsk2woz2_options * options);
+static uint32_t copy_nib_track(uint8_t * bits, const uint8_t * nib, int track_number, const dsk2woz2_options * options);
+static size_t write_info_chunk(uint8_t * dest, int cleaned, int boot_sector_format);
+static size_t write_tmap_chunk(uint8_t * dest);
+static size_t write_trks_chunk(uint8_t * dest, const uint8_t * track_bits[], const uint8_t * source,
+                               track_filler fill_track, const dsk2woz2_options * options,
+                               uint32_t * valid_bits_per_track);
+static size_t write_writ_chunk(uint8_t * dest, const uint8_t * track_bits[], uint32_t valid_bits_per_track);
+static size_t write_writ_entry(uint8_t * dest, int quarter_track, uint32_t crc, uint32_t leader_bits, uint32_t bit_count);
+static uint32_t count_leader_sync_bits(const uint8_t * bits, uint32_t bit_count);
+static uint8_t * begin_chunk(uint8_t * dest, const char * name, size_t data_length);
+static const uint8_t * find_chunk(const uint8_t * woz, size_t woz_size, const char * name, uint32_t * data_length);
+static uint16_t read_uint16(const uint8_t * src);
+static uint32_t read_uint32(const uint8_t * src);
+
+static void write_uint8(uint8_t * dest, uint8_t value);
+static void write_uint16(uint8_t * dest, uint16_t value);
+static void write_uint32(uint8_t * dest, uint32_t value);
+static void write_utf8(uint8_t * dest, const char * utf8string, int n);
+
+static size_t encode_bits_for_track(uint8_t * dest, const uint8_t * src, int track_number, dsk2woz2_sector_format sector_format,
+                                    uint32_t * data_bit_offsets);
+static int logical_sector_for_physical(int physical_sector, dsk2woz2_sector_format sector_format);
+static size_t bits_put_byte(uint8_t * buffer, size_t index, int value);
+static void encode_6_and_2(uint8_t * dest, const uint8_t * src);
+
+static dsk2woz2_sector_format sector_format_for_path(const char * path);
+static dsk2woz2_sector_format detect_sector_format(const uint8_t * dsk, const char * name);
+
+static uint32_t crc32(uint32_t crc, const void * buf, size_t size);
+static uint32_t crc32_shift(uint32_t crc, size_t length);
+static uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, size_t length_b);
+static uint32_t crc32_extend_zeros(uint32_t crc, size_t length);
+static uint32_t crc32_patch(uint32_t crc, const uint8_t * old_bytes, const uint8_t * new_bytes, size_t length,
+                            size_t bytes_after);
+
+typedef enum _trace_name {
+    trace_name_read = 0,
+    trace_name_convert,
+    trace_name_assemble,
+    trace_name_encode,
+    trace_name_crc,
+    trace_name_write,
+    trace_name_verify,
+    trace_name_transfer,            // A round of object store requests
+    trace_name_queue_pending,       // Counters from here on
+    trace_name_queue_completed
+} trace_name;
+
+static uint64_t trace_begin(void);
+static void trace_end(trace_name name, uint64_t start, int arg);
+static void trace_counter(trace_name name, int value);
+static void trace_set_image(const char * label);
+
+static void * queue_worker(void * context);
+static void signal_completion_fd(dsk2woz2_queue * queue);
+static void clear_completion_fd(dsk2woz2_queue * queue);
+
+#ifndef DSK2WOZ2_NO_MAIN
+
+// An input file mapped (or, failing that, read) into memory, along with what it holds.
+typedef struct _input_image {
+    const uint8_t * data;
+    size_t size;
+    int mapped;
+    dsk2woz2_probe probe;
+} input_image;
+
+static int open_input(const char * path, input_image * input);
+static int probe_input(const char * path, input_image * input);
+static void close_input(input_image * input);
+
+// Object store I/O. Inputs and outputs may be s3:// URLs as well as paths.
+typedef struct _s3_transfer {
+    const char * url;
+    const uint8_t * body;       // PUT this, or GET if NULL
+    size_t body_size;
+    uint8_t * response;         // A GET's object; the caller frees it
+    size_t response_size;
+    int status;                 // The HTTP status, or 0 if there was no response
+} s3_transfer;
+
+static int is_s3_url(const char * path);
+static void s3_perform(s3_transfer transfers[], int count);
+static int s3_succeeded(const s3_transfer * transfer);
+static int adopt_transfer(const char * path, s3_transfer * transfer, input_image * input);
+static int store_result(const s3_transfer * transfer);
+static void trace_end_transfer(uint64_t start, int gets, int puts);
+
+// Read-back verification of written outputs.
+typedef enum _verify_mode {
+    verify_mode_none = 0,
+    verify_mode_crc,            // The header and WRIT CRCs match what was read back
+    verify_mode_source          // And it's exactly what converting the input again gives
+} verify_mode;
+
+static int verify_output(const char * output_path, const char * input_path, verify_mode mode,
+                         const dsk2woz2_options * options);
+
+// Settings for batch and worker conversions that aren't part of the conversion itself.
+typedef struct _batch_settings {
+    int worker_count;
+    int write_hfe;          // Also write an HFE image alongside each WOZ
+    double max_images_per_second;       // Budget ceilings; 0 for no limit
+    double max_cpu_percent;             // Of one CPU, so 200 is two CPUs' worth
+    double max_mbytes_per_second;       // Read and written
+    const char * access_log_path;       // Convert the images in it first, hottest first
+    verify_mode verify;                 // What to check once each output is written
+} batch_settings;
+
+static int parse_budget(batch_settings * settings, const char * spec);
+
+static const char * trace_output_path;
+static void write_trace_at_exit(void);
+static int write_output_file(const char * path, const uint8_t * data, size_t size);
+static int write_hfe_file(const char * woz_path, const uint8_t * woz, size_t woz_size);
+static int run_batch(const char * manifest_path, const char * input_directory, const char * output_directory,
+                     const dsk2woz2_options * options, const batch_settings * settings);
+static int run_coordinator(const char * manifest_path, const char * access_log_path, const char * port,
+                           int lease_timeout);
+static int run_worker(const char * address, const dsk2woz2_options * options, const batch_settings * settings);
+static int run_mastering(const char * variants_path, const char * base_path, const dsk2woz2_options * options);
+static int parse_info_edit(dsk2woz2_info_edit * edit, const char * spec);
+static int edit_files(const dsk2woz2_info_edit * edit, int file_count, const char * paths[]);
+
+//
+// Utility entry point
+//
+
+int main(int argc, const char * argv[])
+{
+    dsk2woz2_options options;
+    dsk2woz2_default_options(&options);
+    const char * manifest_path = NULL;
+    const char * input_directory = NULL;
+    const char * output_directory = NULL;
+    const char * variants_path = NULL;
+    const char * coordinator_port = NULL;
+    const char * coordinator_address = NULL;
+    int lease_timeout = LEASE_TIMEOUT_SECONDS;
+    batch_settings settings = { 0 };
+    const char * trace_path = NULL;
+    dsk2woz2_info_edit info_edit;
+    int editing = 0;
+    settings.worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    int arg_index = 1;
+    while (arg_index < argc && argv[arg_index][0] == '-') {
+        if (strcmp(argv[arg_index], "-l") == 0 && arg_index + 1 < argc) {
+            if (!dsk2woz2_set_track_layout(&options, argv[arg_index + 1])) {
+                printf("ERROR: invalid track layout %s\n", argv[arg_index + 1]);
+                return -1;
+            }
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-E") == 0 && arg_index + 1 < argc) {
+            if (!parse_info_edit(&info_edit, argv[arg_index + 1])) {
+                printf("ERROR: invalid INFO edit %s\n", argv[arg_index + 1]);
+                return -1;
+            }
+            editing = 1;
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-m") == 0 && arg_index + 1 < argc) {
+            manifest_path = argv[arg_index + 1];
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-d") == 0 && arg_index + 2 < argc) {
+            input_directory = argv[arg_index + 1];
+            output_directory = argv[arg_index + 2];
+            arg_index += 3;
+        } else if (strcmp(argv[arg_index], "-S") == 0 && arg_index + 1 < argc) {
+            variants_path = argv[arg_index + 1];
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-j") == 0 && arg_index + 1 < argc) {
+            settings.worker_count = atoi(argv[arg_index + 1]);
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-t") == 0 && arg_index + 1 < argc) {
+            trace_path = argv[arg_index + 1];
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-B") == 0 && arg_index + 1 < argc) {
+            if (!parse_budget(&settings, argv[arg_index + 1])) {
+                printf("ERROR: invalid budget %s\n", argv[arg_index + 1]);
+                return -1;
+            }
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-P") == 0 && arg_index + 1 < argc) {
+            settings.access_log_path = argv[arg_index + 1];
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-V") == 0 && arg_index + 1 < argc) {
+            if (strcmp(argv[arg_index + 1], "crc") == 0) {
+                settings.verify = verify_mode_crc;
+            } else if (strcmp(argv[arg_index + 1], "source") == 0) {
+                settings.verify = verify_mode_source;
+            } else {
+                printf("ERROR: invalid verification %s\n", argv[arg_index + 1]);
+                return -1;
+            }
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-H") == 0) {
+            settings.write_hfe = 1;
+            arg_index += 1;
+        } else if (strcmp(argv[arg_index], "-C") == 0 && arg_index + 1 < argc) {
+            coordinator_port = argv[arg_index + 1];
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-W") == 0 && arg_index + 1 < argc) {
+            coordinator_address = argv[arg_index + 1];
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-L") == 0 && arg_index + 1 < argc) {
+            lease_timeout = atoi(argv[arg_index + 1]);
+            arg_index += 2;
+        } else {
+            break;
+        }
+    }
+
+    if (settings.worker_count < 1) {
+        settings.worker_count = 1;
+    }
+    if (lease_timeout < 1) {
+        lease_timeout = LEASE_TIMEOUT_SECONDS;
+    }
+
+    // A worker, coordinator or object store transfer mustn't be taken down by a peer hanging up on it.
+    signal(SIGPIPE, SIG_IGN);
+
+    if (trace_path) {
+        dsk2woz2_trace_start();
+        atexit(write_trace_at_exit);
+        trace_output_path = trace_path;
+    }
+
+    if (editing && argc > arg_index) {
+        return edit_files(&info_edit, argc - arg_index, &argv[arg_index]);
+    }
+    if (variants_path && argc - arg_index == 1) {
+        return run_mastering(variants_path, argv[arg_index], &options);
+    }
+    if (argc == arg_index) {
+        if (manifest_path && coordinator_port) {
+            return run_coordinator(manifest_path, settings.access_log_path, coordinator_port, lease_timeout);
+        } else if (manifest_path || input_directory) {
+            return run_batch(manifest_path, input_directory, output_directory, &options, &settings);
+        } else if (coordinator_address) {
+            return run_worker(coordinator_address, &options, &settings);
+        }
+    }
+
+    if (editing || variants_path || manifest_path || input_directory || coordinator_address || argc - arg_index != 2) {
+        printf("USAGE: dsk2woz2 [-l boot|track,track,...] [-H] [-V crc|source] [-t trace.json] input.dsk output.woz\n");
+        printf("       dsk2woz2 [-l boot|track,track,...] [-H] [-V crc|source] [-t trace.json] [-j threads] [-B budget] [-P access-log] -m manifest\n");
+        printf("       dsk2woz2 [-l boot|track,track,...] [-H] [-V crc|source] [-t trace.json] [-j threads] [-B budget] [-P access-log] -d input-dir output-dir\n");
+        printf("       dsk2woz2 [-P access-log] -m manifest -C port [-L lease-seconds]\n");
+        printf("       dsk2woz2 [-l boot|track,track,...] -S variants base.dsk\n");
+        printf("       dsk2woz2 -E wp=0|1,hw=bits,ram=kb,creator=text image.woz ...\n");
+        printf("       dsk2woz2 [-l boot|track,track,...] [-H] [-V crc|source] [-t trace.json] [-j threads] [-B budget] -W host:port\n");
+        printf("       (budget: images=per-second,cpu=percent,mb=per-second)\n");
+        printf("       (inputs and outputs may be s3://bucket/key URLs, and inputs s3://bucket/pack#N)\n");
+        return -1;
+    }
+    const char * const input_path = argv[arg_index];
+    const char * const woz_path = argv[arg_index + 1];
+
+    // Map the input file and work out what it is.
+    input_image input;
+    int result = open_input(input_path, &input);
+    if (result != 0) {
+        return result;
+    }
+
+    // Create the output buffer and convert straight into it. A WOZ2 image is already
+    // what we'd produce, so it's simply copied.
+    uint8_t * woz = NULL;
+    const uint8_t * woz_image = input.data;
+    size_t woz_image_size = input.size;
+    if (input.probe.format != dsk2woz2_format_woz2) {
+        const size_t woz_capacity = dsk2woz2_woz_capacity_for_image(input.data, &input.probe);
+        woz = malloc(woz_capacity ? woz_capacity : 1);
+        if (!woz) {
+            close_input(&input);
+            printf("ERROR: memory allocation failed");
+            return -2;
+        }
+        trace_set_image(input_path);
+        woz_image_size = dsk2woz2_convert_image(woz, woz_capacity, input.data, &input.probe, &options);
+        woz_image = woz;
+        if (woz_image_size == 0) {
+            free(woz);
+            close_input(&input);
+            printf("ERROR: could not convert %s\n", input_path);
+            return -2;
+        }
+    }
+    
+    // Write the output file(s)
+    result = write_output_file(woz_path, woz_image, woz_image_size);
+    if (result == 0 && settings.write_hfe) {
+        result = write_hfe_file(woz_path, woz_image, woz_image_size);
+    }
+    free(woz);
+    close_input(&input);
+    if (result == 0 && settings.verify != verify_mode_none) {
+        result = verify_output(woz_path, input_path, settings.verify, &options);
+    }
+    return result;
+}
+
+//
+// Command line file handling
+//
+
+// Parses the number in an INFO edit field. Returns 0 if there's no number there, or it's
+// negative or too big for any of the fields.
+static
+int parse_info_value(const char * digits, char ** end, int * value)
+{
+    if (*digits < '0' || *digits > '9') {
+        return 0;
+    }
+    const long parsed = strtol(digits, end, 0);
+    if (parsed > 0xFFFF) {
+        return 0;
+    }
+    *value = (int)parsed;
+    return 1;
+}
+
+// Parses an INFO edit spec, a comma separated list of wp=, hw=, ram= and creator= settings.
+// creator= takes the rest of the spec, commas and all, so it must come last. Returns 0 if
+// the spec is malformed.
+static
+int parse_info_edit(dsk2woz2_info_edit * edit, const char * spec)
+{
+    dsk2woz2_default_info_edit(edit);
+    const char * field = spec;
+    while (*field) {
+        char * end = NULL;
+        int ok = 0;
+        if (strncmp(field, "creator=", 8) == 0) {
+            edit->creator = field + 8;
+            return strlen(edit->creator) <= 32;
+        } else if (strncmp(field, "wp=", 3) == 0) {
+            ok = parse_info_value(field + 3, &end, &edit->write_protected);
+        } else if (strncmp(field, "hw=", 3) == 0) {
+            ok = parse_info_value(field + 3, &end, &edit->compatible_hardware);
+        } else if (strncmp(field, "ram=", 4) == 0) {
+            ok = parse_info_value(field + 4, &end, &edit->required_ram);
+        }
+        if (!ok || !end || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+        field = (*end == ',') ? end + 1 : end;
+    }
+    return edit->write_protected <= 1;
+}
+
+// Edits each file's INFO in place through a shared mapping, so only the pages holding the
+// header and INFO are read and written back. Returns 0 on success, or the utility's exit
+// code for the failure.
+static
+int edit_files(const dsk2woz2_info_edit * edit, int file_count, const char * paths[])
+{
+    int failures = 0;
+    for (int i = 0; i < file_count; i++) {
+        const int fd = open(paths[i], O_RDWR);
+        struct stat file_status;
+        if (fd < 0 || fstat(fd, &file_status) != 0 || file_status.st_size == 0) {
+            printf("ERROR: Could not open %s for writing\n", paths[i]);
+            if (fd >= 0) {
+                close(fd);
+            }
+            failures++;
+            continue;
+        }
+        const size_t size = (size_t)file_status.st_size;
+        uint8_t * woz = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (woz == MAP_FAILED) {
+            printf("ERROR: Could not map %s\n", paths[i]);
+            failures++;
+            continue;
+        }
+        if (!dsk2woz2_edit_info(woz, size, edit)) {
+            printf("ERROR: file %s does not appear to be a WOZ 2.0 image\n", paths[i]);
+            failures++;
+        }
+        munmap(woz, size);
+    }
+    if (failures > 0) {
+        printf("ERROR: %d of %d edits failed\n", failures, file_count);
+        return -7;
+    }
+    return 0;
+}
+
+static
+void write_trace_at_exit(void)
+{
+    if (dsk2woz2_trace_write(trace_output_path) != 0) {
+        printf("ERROR: Could not write trace to %s\n", trace_output_path);
+    }
+}
+
+// Maps the input file and probes it, so that only the pages the probe and the encoder
+// actually touch get read. Falls back to reading the file for things that can't be mapped.
+// Returns 0 on success, or the utility's exit code for the failure.
+static
+int open_input(const char * path, input_image * input)
+{
+    memset(input, 0, sizeof(input_image));
+    trace_set_image(path);
+    const uint64_t trace_start = trace_begin();
+    if (is_s3_url(path)) {
+        s3_transfer transfer = { path, NULL, 0, NULL, 0, 0 };
+        s3_perform(&transfer, 1);
+        trace_end(trace_name_read, trace_start, -1);
+        return adopt_transfer(path, &transfer, input);
+    }
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("ERROR: could not open %s for reading\n", path);
+        return -2;
+    }
+
+    struct stat file_status;
+    if (fstat(fd, &file_status) == 0 && S_ISREG(file_status.st_mode) && file_status.st_size > 0) {
+        void * mapping = mmap(NULL, (size_t)file_status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            input->data = mapping;
+            input->size = (size_t)file_status.st_size;
+            input->mapped = 1;
+        }
+    }
+    if (!input->mapped) {
+        // Not mappable (a pipe, say), so read it all, however big it turns out to be.
+        size_t capacity = 0;
+        uint8_t * data = NULL;
+        ssize_t bytes_read;
+        for (;;) {
+            if (input->size == capacity) {
+                capacity = capacity ? capacity * 2 : NIB_IMAGE_SIZE + 4096;
+                uint8_t * grown = realloc(data, capacity);
+                if (!grown) {
+                    bytes_read = -1;
+                    break;
+                }
+                data = grown;
+            }
+            bytes_read = read(fd, &data[input->size], capacity - input->size);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                break;
+            }
+            input->size += bytes_read;
+        }
+        input->data = data;
+        if (bytes_read < 0) {
+            close(fd);
+            close_input(input);
+            printf("ERROR: could not read %s\n", path);
+            return -2;
+        }
+    }
+    close(fd);
+    trace_end(trace_name_read, trace_start, -1);
+    return probe_input(path, input);
+}
+
+// Takes a fetched object as the input. Returns 0 on success, or the utility's exit code
+// for the failure.
+static
+int adopt_transfer(const char * path, s3_transfer * transfer, input_image * input)
+{
+    memset(input, 0, sizeof(input_image));
+    if (!s3_succeeded(transfer)) {
+        printf("ERROR: could not fetch %s (HTTP status %d)\n", path, transfer->status);
+        return -2;
+    }
+    input->data = transfer->response;
+    input->size = transfer->response_size;
+    transfer->response = NULL;
+    return probe_input(path, input);
+}
+
+// Works out what the input holds. Returns 0 if it's something we take, or the utility's exit
+// code for the failure.
+static
+int probe_input(const char * path, input_image * input)
+{
+    if (!dsk2woz2_probe_image(&input->probe, input->data, input->size, path)) {
+        close_input(input);
+        printf("ERROR: file %s does not appear to be a 5.25\" disk image\n", path);
+        return -2;
+    }
+    switch (input->probe.format) {
+        case dsk2woz2_format_dsk:
+        case dsk2woz2_format_nib:
+        case dsk2woz2_format_woz1:
+        case dsk2woz2_format_woz2:
+            return 0;
+        default:
+            printf("ERROR: file %s is a %s image, which can't be converted\n", path,
+                   dsk2woz2_format_name(input->probe.format));
+            close_input(input);
+            return -2;
+    }
+}
+
+static
+void close_input(input_image * input)
+{
+    if (input->mapped) {
+        munmap((void *)input->data, input->size);
+    } else {
+        free((void *)input->data);
+    }
+    input->data = NULL;
+}
+
+// Returns 0 on success, or the utility's exit code for the failure.
+static
+int write_output_file(const char * path, const uint8_t * data, size_t size)
+{
+    trace_set_image(path);
+    const uint64_t trace_start = trace_begin();
+    if (is_s3_url(path)) {
+        s3_transfer transfer = { path, data, size, NULL, 0, 0 };
+        s3_perform(&transfer, 1);
+        trace_end(trace_name_write, trace_start, -1);
+        return store_result(&transfer);
+    }
+    FILE * const output_file = fopen(path, "wb");
+    if (!output_file) {
+        printf("ERROR: Could not open %s for writing\n", path);
+        return -5;
+    }
+
+    size_t bytes_written = fwrite(data, 1, size, output_file);
+    fclose(output_file);
+    trace_end(trace_name_write, trace_start, -1);
+    
+    if(bytes_written != size) {
+        printf("ERROR: Could not write full image to %s\n", path);
+        return -6;
+    }
+    return 0;
+}
+
+// Returns 0 if the upload succeeded, or the utility's exit code for the failure.
+static
+int store_result(const s3_transfer * transfer)
+{
+    if (transfer->status == 0) {
+        printf("ERROR: Could not open %s for writing\n", transfer->url);
+        return -5;
+    }
+    if (!s3_succeeded(transfer)) {
+        printf("ERROR: Could not write full image to %s (HTTP status %d)\n", transfer->url, transfer->status);
+        return -6;
+    }
+    return 0;
+}
+
+// Writes the HFE version of a WOZ image next to it, swapping the file extension for .hfe.
+// Returns 0 on success, or the utility's exit code for the failure.
+static
+int write_hfe_file(const char * woz_path, const uint8_t * woz, size_t woz_size)
+{
+    const size_t hfe_size = dsk2woz2_woz_to_hfe(NULL, 0, woz, woz_size);
+    if (hfe_size == 0) {
+        // A WOZ2 image passed through as it was may have tracks HFE can't hold.
+        printf("ERROR: could not make an HFE image from %s\n", woz_path);
+        return -2;
+    }
+    const char * extension = strrchr(woz_path, '.');
+    const char * slash = strrchr(woz_path, '/');
+    size_t stem_length = (extension && (!slash || extension > slash)) ? (size_t)(extension - woz_path) : strlen(woz_path);
+    char * hfe_path = malloc(stem_length + 5);
+    uint8_t * hfe = malloc(hfe_size);
+    if (!hfe_path || !hfe) {
+        free(hfe_path);
+        free(hfe);
+        printf("ERROR: memory allocation failed\n");
+        return -2;
+    }
+    memcpy(hfe_path, woz_path, stem_length);
+    strcpy(&hfe_path[stem_length], ".hfe");
+
+    dsk2woz2_woz_to_hfe(hfe, hfe_size, woz, woz_size);
+    const int result = write_output_file(hfe_path, hfe, hfe_size);
+    free(hfe);
+    free(hfe_path);
+    return result;
+}
+
+// One conversion, whether from a manifest, a directory or a coordinator.
+typedef struct _batch_job {
+    char * input_path;
+    char * output_path;
+    long index;                 // Position in the manifest
+    int result;                 // 0 once converted, otherwise the failure's exit code
+    int verify_result;          // Set by the verifier, and merged into result once it's drained
+} batch_job;
+
+//
+// Read-back verification. Each output is read back from the storage and checked, to catch
+// corruption between here and the disk that a successful write wouldn't show.
+//
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+#define DIRECT_IO_ALIGNMENT     4096
+
+// Reads the whole file into an aligned buffer, which the caller frees. O_DIRECT makes the
+// read come from the storage rather than from the page cache the write just filled; not
+// every filesystem takes it, so fall back to a plain read where it's refused. Returns 0 on
+// success, or the utility's exit code for the failure.
+static
+int read_back_file(const char * path, uint8_t ** data, size_t * size)
+{
+    if (is_s3_url(path)) {
+        s3_transfer transfer = { path, NULL, 0, NULL, 0, 0 };
+        s3_perform(&transfer, 1);
+        if (!s3_succeeded(&transfer)) {
+            return -2;
+        }
+        *data = transfer.response;
+        *size = transfer.response_size;
+        return 0;
+    }
+    int direct = (O_DIRECT != 0);
+    int fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        direct = 0;
+        fd = open(path, O_RDONLY);
+    }
+    struct stat file_status;
+    void * buffer = NULL;
+    if (fd < 0 || fstat(fd, &file_status) != 0 ||
+        posix_memalign(&buffer, DIRECT_IO_ALIGNMENT,
+                       ((size_t)file_status.st_size / DIRECT_IO_ALIGNMENT + 1) * DIRECT_IO_ALIGNMENT) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -2;
+    }
+    *size = (size_t)file_status.st_size;
+    *data = buffer;
+
+    // Read in aligned, whole-block requests; the last one comes up short at the end of file.
+    const size_t capacity = (*size / DIRECT_IO_ALIGNMENT + 1) * DIRECT_IO_ALIGNMENT;
+    size_t total = 0;
+    while (fd >= 0 && total < *size) {
+        const ssize_t bytes_read = read(fd, &(*data)[total], capacity - total);
+        if (bytes_read < 0 && errno == EINVAL && direct) {
+            direct = 0;
+            close(fd);
+            fd = open(path, O_RDONLY);
+            total = 0;
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        total += (size_t)bytes_read;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (total != *size) {
+        free(buffer);
+        return -2;
+    }
+    return 0;
+}
+
+// Is the WOZ image exactly what converting the input again gives?
+static
+int matches_source(const uint8_t * woz, size_t woz_size, const char * input_path, const dsk2woz2_options * options)
+{
+    input_image input;
+    if (open_input(input_path, &input) != 0) {
+        return 0;
+    }
+    int matches = 0;
+    if (input.probe.format == dsk2woz2_format_woz2) {
+        matches = (input.size == woz_size) && memcmp(input.data, woz, woz_size) == 0;
+    } else {
+        const size_t capacity = dsk2woz2_woz_capacity_for_image(input.data, &input.probe);
+        uint8_t * expected = malloc(capacity ? capacity : 1);
+        if (expected) {
+            const size_t expected_size = dsk2woz2_convert_image(expected, capacity, input.data, &input.probe, options);
+            matches = (expected_size == woz_size) && memcmp(expected, woz, woz_size) == 0;
+            free(expected);
+        }
+    }
+    close_input(&input);
+    return matches;
+}
+
+// Returns 0 if the output checks out, or the utility's exit code for the failure.
+static
+int verify_output(const char * output_path, const char * input_path, verify_mode mode,
+                  const dsk2woz2_options * options)
+{
+    const uint64_t trace_start = trace_begin();
+    uint8_t * woz = NULL;
+    size_t woz_size;
+    const char * problem = NULL;
+    if (read_back_file(output_path, &woz, &woz_size) != 0) {
+        problem = "could not read it back";
+    } else if (!dsk2woz2_verify_woz(woz, woz_size)) {
+        problem = "its CRCs don't match";
+    } else if (mode == verify_mode_source && !matches_source(woz, woz_size, input_path, options)) {
+        problem = "it doesn't match its source";
+    }
+    free(woz);
+    trace_set_image(output_path);
+    trace_end(trace_name_verify, trace_start, -1);
+    if (problem) {
+        printf("ERROR: %s failed verification: %s\n", output_path, problem);
+        return -9;
+    }
+    return 0;
+}
+
+// The verifier runs as its own pipeline stage, on its own thread, so reading back and
+// checking one image overlaps converting and writing the next ones.
+typedef struct _verify_item {
+    batch_job * job;
+    struct _verify_item * next;
+} verify_item;
+
+typedef struct _verifier {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    verify_item * pending;
+    verify_item ** pending_tail;
+    int busy;
+    int shutting_down;
+    long failures;              // Since the last drain
+    verify_mode mode;
+    dsk2woz2_options options;
+    pthread_t thread;
+} verifier;
+
+static
+void * verifier_thread(void * context)
+{
+    verifier * v = context;
+    pthread_mutex_lock(&v->lock);
+    for (;;) {
+        while (!v->pending && !v->shutting_down) {
+            pthread_cond_wait(&v->changed, &v->lock);
+        }
+        verify_item * item = v->pending;
+        if (!item) {
+            break;
+        }
+        v->pending = item->next;
+        if (!v->pending) {
+            v->pending_tail = &v->pending;
+        }
+        v->busy = 1;
+        pthread_mutex_unlock(&v->lock);
+
+        const int result = verify_output(item->job->output_path, item->job->input_path, v->mode, &v->options);
+
+        pthread_mutex_lock(&v->lock);
+        if (result != 0) {
+            item->job->verify_result = result;
+            v->failures++;
+        }
+        v->busy = 0;
+        pthread_cond_broadcast(&v->changed);
+        free(item);
+    }
+    pthread_mutex_unlock(&v->lock);
+    return NULL;
+}
+
+static
+verifier * create_verifier(verify_mode mode, const dsk2woz2_options * options)
+{
+    verifier * v = calloc(1, sizeof(verifier));
+    if (!v) { return NULL; }
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->changed, NULL);
+    v->pending_tail = &v->pending;
+    v->mode = mode;
+    v->options = *options;
+    if (pthread_create(&v->thread, NULL, verifier_thread, v) != 0) {
+        free(v);
+        return NULL;
+    }
+    return v;
+}
+
+// Queues the job's output for verification. A failure is recorded in the job's verify_result,
+// under the verifier's lock; read it only after verifier_drain.
+static
+void verifier_submit(verifier * v, batch_job * job)
+{
+    verify_item * item = malloc(sizeof(verify_item));
+    if (!item) {
+        // Can't queue it, so check it here rather than not at all.
+        const int result = verify_output(job->output_path, job->input_path, v->mode, &v->options);
+        pthread_mutex_lock(&v->lock);
+        if (result != 0) {
+            job->verify_result = result;
+            v->failures++;
+        }
+        pthread_mutex_unlock(&v->lock);
+        return;
+    }
+    item->job = job;
+    item->next = NULL;
+    pthread_mutex_lock(&v->lock);
+    *v->pending_tail = item;
+    v->pending_tail = &item->next;
+    pthread_cond_broadcast(&v->changed);
+    pthread_mutex_unlock(&v->lock);
+}
+
+// Waits for everything queued to be verified. Returns the number that failed.
+static
+long verifier_drain(verifier * v)
+{
+    pthread_mutex_lock(&v->lock);
+    while (v->pending || v->busy) {
+        pthread_cond_wait(&v->changed, &v->lock);
+    }
+    const long failures = v->failures;
+    v->failures = 0;
+    pthread_mutex_unlock(&v->lock);
+    return failures;
+}
+
+static
+void destroy_verifier(verifier * v)
+{
+    pthread_mutex_lock(&v->lock);
+    v->shutting_down = 1;
+    pthread_cond_broadcast(&v->changed);
+    pthread_mutex_unlock(&v->lock);
+    pthread_join(v->thread, NULL);
+    pthread_mutex_destroy(&v->lock);
+    pthread_cond_destroy(&v->changed);
+    free(v);
+}
+
+//
+// Batch conversion. The manifest lists one conversion per line, as the input path and the
+// output path separated by a tab. The inputs are read and the outputs written on this
+// thread, while the encoding itself runs on the conversion queue's workers.
+//
+
+typedef struct _batch_slot {
+    dsk2woz2_request request;
+    batch_job * job;
+    input_image input;
+    double start_time;          // When it was submitted
+    uint8_t * woz;
+    size_t woz_capacity;        // Grown as needed; upgraded WOZ1 images can be bigger
+} batch_slot;
+
+// Throttling to a budget. The measured cost of an image (CPU time and bytes moved) gives the
+// gap to leave between starting images so as to stay under every ceiling, and the measured
+// time to convert one gives how many need to be in flight at once to keep that pace.
+typedef struct _throttle {
+    int enabled;
+    int concurrency;                // How many images may be in flight
+    double interval;                // Seconds between starting images
+    const char * limit;             // The ceiling that's currently binding
+    double next_start;
+    double seconds_per_image;       // Measured averages
+    double cpu_seconds_per_image;
+    double bytes_per_image;
+    double sample_time;             // Where the current measurement sample began
+    double sample_cpu;
+    double sample_bytes;
+    long sample_images;
+    double start_time;              // Totals, for the report
+    double start_cpu;
+    double limited_seconds;
+    double bytes;
+    long images;
+} throttle;
+
+typedef struct _batch_converter {
+    dsk2woz2_queue * queue;
+    verifier * verifier;        // Or NULL if not verifying
+    dsk2woz2_options options;
+    batch_settings settings;
+    throttle throttle;
+    batch_slot * slots;
+    batch_slot ** free_slots;
+    batch_slot ** picked;
+    batch_slot ** uploading;    // Converted, with their images still to store
+    dsk2woz2_request ** requests;
+    s3_transfer * transfers;    // For the slots' objects, fetched or stored together
+    int slot_count;
+    void (* running_low)(void * context);   // If set, called once per convert_jobs as it nears the end
+    void * running_low_context;
+} batch_converter;
+
+#define BATCH_SLOTS_PER_WORKER  2
+#define MANIFEST_LINE_MAX       4096
+
+static
+char * copy_string(const char * s, size_t length)
+{
+    char * copy = malloc(length + 1);
+    if (copy) {
+        memcpy(copy, s, length);
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+// Parses an "input<TAB>output" line into the job. Returns 0 if the line is malformed.
+static
+int parse_job(batch_job * job, const char * line, long index)
+{
+    const char * tab = strchr(line, '\t');
+    if (!tab) {
+        return 0;
+    }
+    job->input_path = copy_string(line, tab - line);
+    job->output_path = copy_string(tab + 1, strcspn(tab + 1, "\t\r\n"));
+    job->index = index;
+    job->result = 0;
+    return job->input_path && job->output_path;
+}
+
+static
+void free_jobs(batch_job * jobs, long job_count)
+{
+    for (long i = 0; i < job_count; i++) {
+        free(jobs[i].input_path);
+        free(jobs[i].output_path);
+    }
+    free(jobs);
+}
+
+// Returns the number of jobs read, or -1 if the manifest couldn't be read.
+static
+long read_manifest(const char * path, batch_job ** jobs)
+{
+    FILE * const manifest_file = fopen(path, "r");
+    if (!manifest_file) {
+        printf("ERROR: could not open %s for reading\n", path);
+        return -1;
+    }
+
+    long job_count = 0;
+    long job_capacity = 0;
+    *jobs = NULL;
+    char line[MANIFEST_LINE_MAX];
+    while (fgets(line, sizeof(line), manifest_file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (job_count == job_capacity) {
+            job_capacity = job_capacity ? job_capacity * 2 : 64;
+            batch_job * grown = realloc(*jobs, job_capacity * sizeof(batch_job));
+            if (!grown) {
+                fclose(manifest_file);
+                return -1;
+            }
+            *jobs = grown;
+        }
+        if (!parse_job(&(*jobs)[job_count], line, job_count)) {
+            printf("ERROR: manifest line \"%s\" is not \"input<TAB>output\"\n", line);
+            continue;
+        }
+        job_count++;
+    }
+    fclose(manifest_file);
+    return job_count;
+}
+
+static
+int compare_jobs_by_input(const void * a, const void * b)
+{
+    return strcmp(((const batch_job *)a)->input_path, ((const batch_job *)b)->input_path);
+}
+
+static
+int compare_jobs_by_output(const void * a, const void * b)
+{
+    return strcmp((*(batch_job * const *)a)->output_path, (*(batch_job * const *)b)->output_path);
+}
+
+// Makes a job for every file in the input directory, writing to the same name in the
+// output directory with a .woz extension. Returns the number of jobs, or -1 on failure,
+// including when two inputs (game.dsk and game.po, say) would be written to the same output.
+static
+long read_directory(const char * input_directory, const char * output_directory, batch_job ** jobs)
+{
+    // The inputs are mapped while the outputs are written, so they mustn't be the same files.
+    char input_real[PATH_MAX];
+    char output_real[PATH_MAX];
+    if (!realpath(input_directory, input_real) || !realpath(output_directory, output_real)) {
+        printf("ERROR: could not find %s or %s\n", input_directory, output_directory);
+        return -1;
+    }
+    if (strcmp(input_real, output_real) == 0) {
+        printf("ERROR: the input and output directories must be different\n");
+        return -1;
+    }
+    DIR * const directory = opendir(input_directory);
+    if (!directory) {
+        printf("ERROR: could not open %s for reading\n", input_directory);
+        return -1;
+    }
+
+    long job_count = 0;
+    long job_capacity = 0;
+    *jobs = NULL;
+    struct dirent * entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char input_path[MANIFEST_LINE_MAX];
+        char output_path[MANIFEST_LINE_MAX];
+        struct stat file_status;
+        snprintf(input_path, sizeof(input_path), "%s/%s", input_directory, entry->d_name);
+        if (stat(input_path, &file_status) != 0 || !S_ISREG(file_status.st_mode)) {
+            continue;
+        }
+        const char * extension = strrchr(entry->d_name, '.');
+        const int stem_length = extension ? (int)(extension - entry->d_name) : (int)strlen(entry->d_name);
+        snprintf(output_path, sizeof(output_path), "%s/%.*s.woz", output_directory, stem_length, entry->d_name);
+
+        if (job_count == job_capacity) {
+            job_capacity = job_capacity ? job_capacity * 2 : 64;
+            batch_job * grown = realloc(*jobs, job_capacity * sizeof(batch_job));
+            if (!grown) {
+                closedir(directory);
+                return -1;
+            }
+            *jobs = grown;
+        }
+        batch_job * job = &(*jobs)[job_count];
+        job->input_path = copy_string(input_path, strlen(input_path));
+        job->output_path = copy_string(output_path, strlen(output_path));
+        job->result = 0;
+        if (job->input_path && job->output_path) {
+            job_count++;
+        }
+    }
+    closedir(directory);
+
+    // Convert in name order rather than whatever order the directory happens to list.
+    qsort(*jobs, job_count, sizeof(batch_job), compare_jobs_by_input);
+    for (long i = 0; i < job_count; i++) {
+        (*jobs)[i].index = i;
+    }
+
+    batch_job ** by_output = malloc((job_count + 1) * sizeof(batch_job *));
+    int clash = !by_output;
+    for (long i = 0; by_output && i < job_count; i++) {
+        by_output[i] = &(*jobs)[i];
+    }
+    if (by_output) {
+        qsort(by_output, job_count, sizeof(batch_job *), compare_jobs_by_output);
+    }
+    for (long i = 1; by_output && i < job_count; i++) {
+        if (strcmp(by_output[i - 1]->output_path, by_output[i]->output_path) == 0) {
+            printf("ERROR: %s and %s would both be written to %s\n", by_output[i - 1]->input_path,
+                   by_output[i]->input_path, by_output[i]->output_path);
+            clash = 1;
+        }
+    }
+    free(by_output);
+    if (clash) {
+        free_jobs(*jobs, job_count);
+        return -1;
+    }
+    return job_count;
+}
+
+static
+double monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1e9);
+}
+
+static
+double cpu_seconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + (usage.ru_utime.tv_usec / 1e6) +
+           usage.ru_stime.tv_sec + (usage.ru_stime.tv_usec / 1e6);
+}
+
+// Parses a budget spec, a comma separated list of images=, cpu= and mb= ceilings. Returns 0
+// if the spec is malformed.
+static
+int parse_budget(batch_settings * settings, const char * spec)
+{
+    const char * field = spec;
+    while (*field) {
+        char * end = NULL;
+        if (strncmp(field, "images=", 7) == 0) {
+            settings->max_images_per_second = strtod(field + 7, &end);
+        } else if (strncmp(field, "cpu=", 4) == 0) {
+            settings->max_cpu_percent = strtod(field + 4, &end);
+        } else if (strncmp(field, "mb=", 3) == 0) {
+            settings->max_mbytes_per_second = strtod(field + 3, &end);
+        }
+        if (!end || end == field || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+        field = (*end == ',') ? end + 1 : end;
+    }
+    return settings->max_images_per_second >= 0 && settings->max_cpu_percent >= 0 &&
+           settings->max_mbytes_per_second >= 0;
+}
+
+static
+void throttle_init(throttle * t, const batch_settings * settings, int slot_count)
+{
+    memset(t, 0, sizeof(throttle));
+    t->enabled = settings->max_images_per_second > 0 || settings->max_cpu_percent > 0 ||
+                 settings->max_mbytes_per_second > 0;
+    // With nothing measured yet, start gently: one image at a time, and for a bandwidth
+    // ceiling, paced as if every image were a DSK read and a WOZ written. CPU use can't be
+    // guessed at, so any overshoot before the first sample is made up for afterwards.
+    t->concurrency = t->enabled ? 1 : slot_count;
+    if (settings->max_images_per_second > 0) {
+        t->interval = 1.0 / settings->max_images_per_second;
+        t->limit = "images/s";
+    }
+    if (settings->max_mbytes_per_second > 0) {
+        t->bytes_per_image = DSK_IMAGE_SIZE + WOZ_IMAGE_SIZE;
+        if (t->bytes_per_image / (settings->max_mbytes_per_second * 1e6) > t->interval) {
+            t->interval = t->bytes_per_image / (settings->max_mbytes_per_second * 1e6);
+            t->limit = "MB/s";
+        }
+    }
+    // Each image waits out its share of the budget before it starts, even the first, so that
+    // the run never gets ahead of the ceiling.
+    t->start_time = t->sample_time = monotonic_seconds();
+    t->next_start = t->start_time + t->interval;
+    t->start_cpu = t->sample_cpu = cpu_seconds();
+}
+
+// Recomputes the pacing and concurrency from the costs measured since the last sample.
+static
+void throttle_update(throttle * t, const batch_settings * settings, int slot_count, double now)
+{
+    const long images = t->images - t->sample_images;
+    // Take the first sample as soon as a few images are in, so the start isn't a burst.
+    if (images == 0 || (now - t->sample_time < 0.25 && (t->sample_images > 0 || images < 4))) {
+        return;
+    }
+    const double cpu = cpu_seconds();
+    const double smoothing = (t->sample_images == 0) ? 1.0 : 0.3;
+    t->cpu_seconds_per_image += smoothing * (((cpu - t->sample_cpu) / images) - t->cpu_seconds_per_image);
+    t->bytes_per_image += smoothing * (((t->bytes - t->sample_bytes) / images) - t->bytes_per_image);
+    t->sample_time = now;
+    t->sample_cpu = cpu;
+    t->sample_bytes = t->bytes;
+    t->sample_images = t->images;
+
+    t->interval = 0;
+    t->limit = NULL;
+    if (settings->max_images_per_second > 0) {
+        t->interval = 1.0 / settings->max_images_per_second;
+        t->limit = "images/s";
+    }
+    if (settings->max_cpu_percent > 0 &&
+        t->cpu_seconds_per_image * 100 / settings->max_cpu_percent > t->interval) {
+        t->interval = t->cpu_seconds_per_image * 100 / settings->max_cpu_percent;
+        t->limit = "CPU";
+    }
+    if (settings->max_mbytes_per_second > 0 &&
+        t->bytes_per_image / (settings->max_mbytes_per_second * 1e6) > t->interval) {
+        t->interval = t->bytes_per_image / (settings->max_mbytes_per_second * 1e6);
+        t->limit = "MB/s";
+    }
+
+    // Hold the next start back until the run as a whole, with that image in it, is within the
+    // budget again, which makes up for anything that went over before the costs were known.
+    double within_budget = 0;
+    if (settings->max_cpu_percent > 0) {
+        within_budget = (cpu - t->start_cpu + t->cpu_seconds_per_image) * 100 / settings->max_cpu_percent;
+    }
+    const double bytes = t->bytes + t->bytes_per_image;
+    if (settings->max_mbytes_per_second > 0 && bytes / (settings->max_mbytes_per_second * 1e6) > within_budget) {
+        within_budget = bytes / (settings->max_mbytes_per_second * 1e6);
+    }
+    if (t->start_time + within_budget > t->next_start) {
+        t->next_start = t->start_time + within_budget;
+    }
+
+    // Enough in flight to cover one conversion's time at that pace, and one more to spare.
+    int concurrency = (t->interval > 0) ? (int)(t->seconds_per_image / t->interval) + 2 : slot_count;
+    t->concurrency = (concurrency < slot_count) ? concurrency : slot_count;
+}
+
+static
+void throttle_report(const throttle * t)
+{
+    const double elapsed = monotonic_seconds() - t->start_time;
+    if (!t->enabled || t->limited_seconds < 0.1 * elapsed) {
+        return;
+    }
+    printf("Budget-limited by %s for %.1f of %.1f seconds: %.1f images/s, %.0f%% CPU, %.1f MB/s\n",
+           t->limit ? t->limit : "budget", t->limited_seconds, elapsed,
+           t->images / elapsed, ((cpu_seconds() - t->start_cpu) * 100) / elapsed, t->bytes / (elapsed * 1e6));
+}
+
+//
+// Priority ordering. An access log lists the images people actually use, one per line: its
+// path, its hit count and optionally the Unix time of its last access, separated by tabs.
+// Those images are converted first, hottest first; everything else follows in its original
+// order, so the bulk of the run still streams through the inputs sequentially.
+//
+
+typedef struct _access_entry {
+    char * path;
+    double score;
+} access_entry;
+
+typedef struct _prioritized_job {
+    batch_job job;
+    double score;               // Or -1 if the image isn't in the access log
+} prioritized_job;
+
+static
+int compare_access_entries(const void * a, const void * b)
+{
+    return strcmp(((const access_entry *)a)->path, ((const access_entry *)b)->path);
+}
+
+static
+int compare_prioritized_jobs(const void * a, const void * b)
+{
+    const prioritized_job * job_a = a;
+    const prioritized_job * job_b = b;
+    if (job_a->score != job_b->score) {
+        return (job_a->score > job_b->score) ? -1 : 1;
+    }
+    return (job_a->job.index > job_b->job.index) - (job_a->job.index < job_b->job.index);
+}
+
+// Returns the number of entries read, sorted by path, or -1 if the log couldn't be read.
+// An image's score is its hit count, discounted by a day of age for every day since its
+// last access.
+static
+long read_access_log(const char * path, access_entry ** entries)
+{
+    FILE * const log_file = fopen(path, "r");
+    if (!log_file) {
+        printf("ERROR: could not open %s for reading\n", path);
+        return -1;
+    }
+
+    const time_t now = time(NULL);
+    long entry_count = 0;
+    long entry_capacity = 0;
+    *entries = NULL;
+    char line[MANIFEST_LINE_MAX];
+    while (fgets(line, sizeof(line), log_file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char * tab = strchr(line, '\t');
+        if (line[0] == '#' || !tab) {
+            continue;
+        }
+        // A line without a usable hit count says nothing about the image, so it mustn't rank
+        // it above the images missing from the log.
+        char * hits_end;
+        const double hits = strtod(tab + 1, &hits_end);
+        if (hits_end == tab + 1 || (*hits_end != '\0' && *hits_end != '\t') || !(hits >= 0)) {
+            continue;
+        }
+        if (entry_count == entry_capacity) {
+            entry_capacity = entry_capacity ? entry_capacity * 2 : 64;
+            access_entry * grown = realloc(*entries, entry_capacity * sizeof(access_entry));
+            if (!grown) {
+                fclose(log_file);
+                return -1;
+            }
+            *entries = grown;
+        }
+        const long long last_access = (*hits_end == '\t') ? strtoll(hits_end + 1, NULL, 10) : 0;
+        const double age_days = (last_access > 0 && last_access < now) ? (now - last_access) / 86400.0 : 0;
+        access_entry * entry = &(*entries)[entry_count];
+        entry->path = copy_string(line, tab - line);
+        entry->score = hits / (1 + age_days);
+        if (entry->path) {
+            entry_count++;
+        }
+    }
+    fclose(log_file);
+    qsort(*entries, entry_count, sizeof(access_entry), compare_access_entries);
+    return entry_count;
+}
+
+// Reorders the jobs by their images' scores in the access log, looked up by output path and
+// then by input path, and renumbers their indexes to match. Returns 0 if the log couldn't
+// be read.
+static
+int prioritize_jobs(batch_job * jobs, long job_count, const char * access_log_path)
+{
+    access_entry * entries;
+    const long entry_count = read_access_log(access_log_path, &entries);
+    prioritized_job * prioritized = calloc(job_count + 1, sizeof(prioritized_job));
+    if (entry_count < 0 || !prioritized) {
+        free(prioritized);
+        return 0;
+    }
+
+    for (long i = 0; i < job_count; i++) {
+        access_entry key = { jobs[i].output_path, 0 };
+        const access_entry * entry = bsearch(&key, entries, entry_count, sizeof(access_entry), compare_access_entries);
+        if (!entry) {
+            key.path = jobs[i].input_path;
+            entry = bsearch(&key, entries, entry_count, sizeof(access_entry), compare_access_entries);
+        }
+        prioritized[i].job = jobs[i];
+        prioritized[i].job.index = i;
+        prioritized[i].score = entry ? entry->score : -1;
+    }
+    qsort(prioritized, job_count, sizeof(prioritized_job), compare_prioritized_jobs);
+    for (long i = 0; i < job_count; i++) {
+        jobs[i] = prioritized[i].job;
+        jobs[i].index = i;
+    }
+
+    free(prioritized);
+    for (long i = 0; i < entry_count; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+    return 1;
+}
+
+static
+void destroy_batch_converter(batch_converter * converter)
+{
+    // Unnecessary boy scoutery...
+    if (converter->queue) {
+        dsk2woz2_queue_destroy(converter->queue);
+    }
+    if (converter->verifier) {
+        destroy_verifier(converter->verifier);
+    }
+    for (int i = 0; converter->slots && i < converter->slot_count; i++) {
+        free(converter->slots[i].woz);
+    }
+    free(converter->transfers);
+    free(converter->requests);
+    free(converter->uploading);
+    free(converter->picked);
+    free(converter->free_slots);
+    free(converter->slots);
+    free(converter);
+}
+
+static
+batch_converter * create_batch_converter(const dsk2woz2_options * options, const batch_settings * settings)
+{
+    batch_converter * converter = calloc(1, sizeof(batch_converter));
+    if (!converter) { return NULL; }
+    converter->options = *options;
+    converter->settings = *settings;
+    converter->slot_count = settings->worker_count * BATCH_SLOTS_PER_WORKER;
+    converter->slots = calloc(converter->slot_count, sizeof(batch_slot));
+    converter->free_slots = calloc(converter->slot_count, sizeof(batch_slot *));
+    converter->picked = calloc(converter->slot_count, sizeof(batch_slot *));
+    converter->uploading = calloc(converter->slot_count, sizeof(batch_slot *));
+    converter->requests = calloc(converter->slot_count, sizeof(dsk2woz2_request *));
+    converter->transfers = calloc(converter->slot_count, sizeof(s3_transfer));
+    converter->queue = dsk2woz2_queue_create(settings->worker_count);
+    throttle_init(&converter->throttle, settings, converter->slot_count);
+    if (settings->verify != verify_mode_none) {
+        converter->verifier = create_verifier(settings->verify, options);
+    }
+    if (!converter->slots || !converter->free_slots || !converter->picked || !converter->uploading ||
+        !converter->requests || !converter->transfers || !converter->queue ||
+        (settings->verify != verify_mode_none && !converter->verifier)) {
+        destroy_batch_converter(converter);
+        return NULL;
+    }
+    return converter;
+}
+
+// Once a job's WOZ image is written (with the given result), writes its HFE image if wanted,
+// then hands it on for verification if that's wanted. Returns 0 on success, or the utility's
+// exit code for the failure.
+static
+int finish_job_outputs(const batch_converter * converter, batch_job * job,
+                       const uint8_t * woz, size_t woz_size, int result)
+{
+    if (result == 0 && converter->settings.write_hfe) {
+        result = write_hfe_file(job->output_path, woz, woz_size);
+    }
+    if (result == 0 && converter->verifier) {
+        verifier_submit(converter->verifier, job);
+    }
+    return result;
+}
+
+// Writes a job's WOZ image and finishes it off. Returns 0 on success, or the utility's exit
+// code for the failure.
+static
+int write_job_outputs(const batch_converter * converter, batch_job * job,
+                      const uint8_t * woz, size_t woz_size)
+{
+    if (woz_size == 0) {
+        printf("ERROR: could not convert %s\n", job->input_path);
+        return -2;
+    }
+    return finish_job_outputs(converter, job, woz, woz_size, write_output_file(job->output_path, woz, woz_size));
+}
+
+// Moves the slots' objects: fetches the picked slots' inputs and stores the finished images
+// of the slots waiting to upload, in one go so that the GETs and PUTs share the connections.
+// The picked slots' other inputs are then read from their files.
+static
+void transfer_objects(batch_converter * converter, int picked_count, int upload_count)
+{
+    int transfer_count = 0;
+    for (int i = 0; i < picked_count; i++) {
+        const char * path = converter->picked[i]->job->input_path;
+        if (is_s3_url(path)) {
+            converter->transfers[transfer_count++] = (s3_transfer){ path, NULL, 0, NULL, 0, 0 };
+        }
+    }
+    for (int i = 0; i < upload_count; i++) {
+        const batch_slot * slot = converter->uploading[i];
+        converter->transfers[transfer_count++] = (s3_transfer){ slot->job->output_path, slot->woz,
+                                                                slot->request.woz_size, NULL, 0, 0 };
+    }
+    if (transfer_count > 0) {
+        trace_set_image("object store");
+        const uint64_t trace_start = trace_begin();
+        s3_perform(converter->transfers, transfer_count);
+        trace_end_transfer(trace_start, transfer_count - upload_count, upload_count);
+    }
+
+    transfer_count = 0;
+    for (int i = 0; i < picked_count; i++) {
+        batch_slot * slot = converter->picked[i];
+        if (is_s3_url(slot->job->input_path)) {
+            slot->job->result = adopt_transfer(slot->job->input_path, &converter->transfers[transfer_count++],
+                                               &slot->input);
+        } else {
+            slot->job->result = open_input(slot->job->input_path, &slot->input);
+        }
+    }
+    for (int i = 0; i < upload_count; i++) {
+        batch_slot * slot = converter->uploading[i];
+        const int stored = store_result(&converter->transfers[transfer_count++]);
+        slot->job->result = finish_job_outputs(converter, slot->job, slot->woz, slot->request.woz_size, stored);
+    }
+}
+
+// Converts every job, recording each one's result. Returns the number that failed.
+static
+long convert_jobs(batch_converter * converter, batch_job * jobs, long job_count)
+{
+    int free_count = 0;
+    for (int i = 0; i < converter->slot_count; i++) {
+        converter->free_slots[free_count++] = &converter->slots[i];
+    }
+
+    throttle * const t = &converter->throttle;
+    long next_job = 0;
+    long failures = 0;
+    int in_flight = 0;
+    int upload_count = 0;
+    void (* running_low)(void *) = converter->running_low;
+    while (next_job < job_count || in_flight > 0 || upload_count > 0) {
+        // Once there's no more than the workers' worth left, tell the caller, so that it can
+        // line up the next jobs while these are still keeping the workers busy.
+        if (running_low && (job_count - next_job) + in_flight + upload_count <= converter->settings.worker_count) {
+            running_low(converter->running_low_context);
+            running_low = NULL;
+        }
+
+        // Map inputs into every free slot and submit them together. When throttled, only as
+        // many as the budget allows are in flight, and they're started at its pace.
+        int picked_count = 0;
+        while (free_count > 0 && next_job < job_count && in_flight + picked_count < t->concurrency) {
+            const double now = t->enabled ? monotonic_seconds() : 0;
+            if (t->enabled && now < t->next_start) {
+                break;
+            }
+            t->next_start = ((now > t->next_start) ? now : t->next_start) + t->interval;
+            batch_slot * slot = converter->free_slots[--free_count];
+            slot->job = &jobs[next_job++];
+            slot->job->verify_result = 0;
+            slot->start_time = now;
+            converter->picked[picked_count++] = slot;
+        }
+        transfer_objects(converter, picked_count, upload_count);
+        for (int i = 0; i < upload_count; i++) {
+            batch_slot * slot = converter->uploading[i];
+            if (slot->job->result != 0) {
+                failures++;
+            }
+            converter->free_slots[free_count++] = slot;
+        }
+        upload_count = 0;
+
+        int request_count = 0;
+        for (int i = 0; i < picked_count; i++) {
+            batch_slot * slot = converter->picked[i];
+            if (slot->job->result == 0) {
+                t->bytes += slot->input.size;
+            }
+            if (slot->job->result == 0 && slot->input.probe.format == dsk2woz2_format_woz2) {
+                // Already a WOZ2 image; there's nothing for the workers to do.
+                slot->job->result = write_job_outputs(converter, slot->job, slot->input.data, slot->input.size);
+                t->bytes += slot->input.size;
+                close_input(&slot->input);
+            } else if (slot->job->result == 0) {
+                const size_t woz_capacity = dsk2woz2_woz_capacity_for_image(slot->input.data, &slot->input.probe);
+                if (woz_capacity > slot->woz_capacity) {
+                    uint8_t * grown = realloc(slot->woz, woz_capacity);
+                    if (grown) {
+                        slot->woz = grown;
+                        slot->woz_capacity = woz_capacity;
+                    }
+                }
+                slot->request.image = slot->input.data;
+                slot->request.probe = slot->input.probe;
+                slot->request.woz = slot->woz;
+                slot->request.woz_capacity = slot->woz_capacity;
+                slot->request.options = converter->options;
+                slot->request.user_tag = slot;
+                slot->request.name = slot->job->input_path;
+                converter->requests[request_count++] = &slot->request;
+                continue;
+            }
+            if (slot->job->result != 0) {
+                failures++;
+            }
+            t->images++;
+            converter->free_slots[free_count++] = slot;
+        }
+        if (request_count > 0) {
+            dsk2woz2_queue_submit(converter->queue, converter->requests, request_count);
+            in_flight += request_count;
+        }
+        const int held_back = t->enabled && free_count > 0 && next_job < job_count;
+        if (in_flight == 0 && !held_back) {
+            continue;
+        }
+
+        // Write out whatever has finished, waiting for at least one. If it's only the pacing
+        // holding the next image back, wait no longer than that.
+        const double wait_start = t->enabled ? monotonic_seconds() : 0;
+        int wait = 1;
+        if (held_back && in_flight < t->concurrency) {
+            const double delay = t->next_start - wait_start;
+            const int timeout = (delay > 0) ? (int)(delay * 1000) + 1 : 0;
+            if (in_flight > 0) {
+                struct pollfd completion = { dsk2woz2_queue_fd(converter->queue), POLLIN, 0 };
+                poll(&completion, 1, timeout);
+            } else {
+                poll(NULL, 0, timeout);     // usleep may refuse delays of a second or more
+            }
+            wait = 0;
+        }
+        const int completed_count = dsk2woz2_queue_reap(converter->queue, converter->requests,
+                                                        converter->slot_count, wait);
+        const double now = t->enabled ? monotonic_seconds() : 0;
+        if (held_back) {
+            t->limited_seconds += now - wait_start;
+        }
+
+        // Images bound for the object store wait for the next round of transfers, to go
+        // alongside the fetches for the next inputs.
+        for (int i = 0; i < completed_count; i++) {
+            batch_slot * slot = converter->requests[i]->user_tag;
+            close_input(&slot->input);
+            if (slot->request.woz_size > 0 && is_s3_url(slot->job->output_path)) {
+                converter->uploading[upload_count++] = slot;
+            } else {
+                slot->job->result = write_job_outputs(converter, slot->job, slot->woz, slot->request.woz_size);
+                if (slot->job->result != 0) {
+                    failures++;
+                }
+                converter->free_slots[free_count++] = slot;
+            }
+            t->bytes += slot->request.woz_size;
+            t->seconds_per_image += (t->images == 0 ? 1.0 : 0.3) * ((now - slot->start_time) - t->seconds_per_image);
+            t->images++;
+            in_flight--;
+        }
+        if (t->enabled) {
+            throttle_update(t, &converter->settings, converter->slot_count, now);
+        }
+    }
+    if (converter->verifier) {
+        // Only now is the verifier done with the jobs, so their results can be merged.
+        failures += verifier_drain(converter->verifier);
+        for (long i = 0; i < job_count; i++) {
+            if (jobs[i].verify_result != 0) {
+                jobs[i].result = jobs[i].verify_result;
+            }
+        }
+    }
+    return failures;
+}
+
+static
+int run_batch(const char * manifest_path, const char * input_directory, const char * output_directory,
+              const dsk2woz2_options * options, const batch_settings * settings)
+{
+    batch_job * jobs;
+    const long job_count = manifest_path ? read_manifest(manifest_path, &jobs) :
+                                           read_directory(input_directory, output_directory, &jobs);
+    if (job_count < 0) {
+        return -2;
+    }
+    if (settings->access_log_path && !prioritize_jobs(jobs, job_count, settings->access_log_path)) {
+        free_jobs(jobs, job_count);
+        return -2;
+    }
+
+    batch_converter * converter = create_batch_converter(options, settings);
+    if (!converter) {
+        printf("ERROR: memory allocation failed");
+        return -2;
+    }
+    const long failures = convert_jobs(converter, jobs, job_count);
+    throttle_report(&converter->throttle);
+    destroy_batch_converter(converter);
+    free_jobs(jobs, job_count);
+
+    if (failures > 0) {
+        printf("ERROR: %ld of %ld conversions failed\n", failures, job_count);
+        return -7;
+    }
+    return 0;
+}
+
+//
+// Mastering. The variants file lists one copy per line: its output path, then any number of
+// patches, each <offset>:<hex bytes> or <offset>:"<text>, separated by tabs. The offsets are
+// into the base DSK image as stored in its file. Lines starting with # are comments.
+//
+
+#define VARIANT_PATCHES_MAX     64
+
+// Parses a variants line, in place. The patches' data is decoded into data, which must be
+// as big as the line. Returns the number of patches, or -1 if the line is malformed.
+static
+int parse_variant(char * line, char ** output_path, dsk2woz2_patch patches[], uint8_t * data)
+{
+    int patch_count = 0;
+    size_t data_length = 0;
+    *output_path = strtok(line, "\t");
+    char * field;
+    while ((field = strtok(NULL, "\t")) != NULL) {
+        char * end;
+        if (patch_count == VARIANT_PATCHES_MAX) {
+            return -1;
+        }
+        patches[patch_count].offset = strtoul(field, &end, 0);
+        patches[patch_count].data = &data[data_length];
+        if (*end++ != ':') {
+            return -1;
+        }
+        if (*end == '"') {
+            const size_t length = strlen(end + 1);
+            memcpy(&data[data_length], end + 1, length);
+            data_length += length;
+        } else {
+            for (; end[0] && end[1]; end += 2) {
+                char hex[3] = { end[0], end[1], '\0' };
+                char * hex_end;
+                data[data_length++] = (uint8_t)strtoul(hex, &hex_end, 16);
+                if (*hex_end) {
+                    return -1;
+                }
+            }
+            if (*end) {
+                return -1;
+            }
+        }
+        patches[patch_count].length = &data[data_length] - patches[patch_count].data;
+        patch_count++;
+    }
+    return *output_path ? patch_count : -1;
+}
+
+static
+int run_mastering(const char * variants_path, const char * base_path, const dsk2woz2_options * options)
+{
+    input_image input;
+    int result = open_input(base_path, &input);
+    if (result != 0) {
+        return result;
+    }
+    if (input.probe.format != dsk2woz2_format_dsk) {
+        close_input(&input);
+        printf("ERROR: mastering needs a DSK base image\n");
+        return -2;
+    }
+    dsk2woz2_options base_options = *options;
+    base_options.sector_format = input.probe.sector_format;
+    dsk2woz2_master * master = dsk2woz2_master_create(&input.data[input.probe.offset], input.probe.size,
+                                                      &base_options);
+    close_input(&input);
+    FILE * const variants_file = fopen(variants_path, "r");
+    if (!master || !variants_file) {
+        dsk2woz2_master_free(master);
+        printf("ERROR: could not open %s for reading\n", variants_path);
+        return -2;
+    }
+
+    // Each variant is written out as soon as it's made.
+    long variant_count = 0;
+    long failures = 0;
+    char line[MANIFEST_LINE_MAX];
+    uint8_t data[MANIFEST_LINE_MAX];
+    dsk2woz2_patch patches[VARIANT_PATCHES_MAX];
+    while (fgets(line, sizeof(line), variants_file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        char * output_path;
+        variant_count++;
+        const int patch_count = parse_variant(line, &output_path, patches, data);
+        size_t woz_size;
+        const uint8_t * woz = (patch_count >= 0) ? dsk2woz2_master_variant(master, patches, patch_count, &woz_size) : NULL;
+        if (!woz) {
+            printf("ERROR: variant %ld is malformed\n", variant_count);
+            failures++;
+        } else if (write_output_file(output_path, woz, woz_size) != 0) {
+            failures++;
+        }
+    }
+    fclose(variants_file);
+    dsk2woz2_master_free(master);
+
+    if (failures > 0) {
+        printf("ERROR: %ld of %ld variants failed\n", failures, variant_count);
+        return -7;
+    }
+    return 0;
+}
+
+//
+// Distributed conversion. A coordinator owns the manifest and hands the jobs out in small
+// leases to any number of workers over TCP, so faster machines simply come back for more.
+// The inputs and outputs must be reachable by the same paths from every worker. The
+// protocol is line based:
+//
+//   worker:       LEASE <max jobs>
+//   coordinator:  JOBS <lease id> <count>, then <count> lines of <index>\t<input>\t<output>
+//                 WAIT (everything is leased out; ask again shortly)
+//                 DONE (or the connection closes)
+//   worker:       ACK <lease id> <index> OK|FAIL, once per job
+//
+// A lease that isn't fully acknowledged in time, or whose worker disconnects, goes back into
+// the pool. Converting a job twice is harmless, so a late acknowledgement is still accepted.
+//
+
+typedef enum _job_state {
+    job_state_pending = 0,
+    job_state_leased,
+    job_state_done
+} job_state;
+
+typedef struct _coordinator_job {
+    batch_job job;
+    job_state state;
+    long lease_id;
+} coordinator_job;
+
+typedef struct _lease {
+    long id;
+    int connection;
+    time_t expiry;
+    int remaining;
+    int count;
+    long indexes[LEASE_MAX_JOBS];
+} lease;
+
+typedef struct _connection {
+    int fd;
+    size_t buffered;
+    char buffer[MANIFEST_LINE_MAX];
+    char * output;              // Replies not yet taken by the socket
+    size_t output_length;
+    size_t output_capacity;
+} connection;
+
+typedef struct _coordinator {
+    coordinator_job * jobs;
+    long job_count;
+    long done_count;
+    long failures;
+    long * pending;             // Stack of pending job indexes; the next job is on top
+    long pending_count;
+    lease * leases;
+    int lease_count;
+    int lease_capacity;
+    long next_lease_id;
+    int lease_timeout;
+} coordinator;
+
+static
+int send_text(int fd, const char * text)
+{
+    size_t length = strlen(text);
+    while (length > 0) {
+        ssize_t sent = send(fd, text, length, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return 0;
+        }
+        text += sent;
+        length -= sent;
+    }
+    return 1;
+}
+
+// The protocol is all small request/response exchanges, which Nagle's algorithm would
+// otherwise hold back waiting for acknowledgements.
+static
+void set_no_delay(int fd)
+{
+    const int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// Queues a reply to a worker. The coordinator's sockets never block, so that a worker that
+// is busy converting rather than reading can't hold up the rest; poll says when to flush.
+static
+int queue_text(connection * conn, const char * text)
+{
+    const size_t length = strlen(text);
+    if (conn->output_length + length > conn->output_capacity) {
+        size_t capacity = conn->output_capacity ? conn->output_capacity : 4096;
+        while (capacity < conn->output_length + length) {
+            capacity *= 2;
+        }
+        char * grown = realloc(conn->output, capacity);
+        if (!grown) {
+            return 0;
+        }
+        conn->output = grown;
+        conn->output_capacity = capacity;
+    }
+    memcpy(&conn->output[conn->output_length], text, length);
+    conn->output_length += length;
+    return 1;
+}
+
+// Sends as much of the queued output as the socket will take. Returns 0 if the connection failed.
+static
+int flush_connection(connection * conn)
+{
+    size_t offset = 0;
+    while (offset < conn->output_length) {
+        ssize_t sent = send(conn->fd, &conn->output[offset], conn->output_length - offset, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (sent <= 0) {
+            return 0;
+        }
+        offset += sent;
+    }
+    memmove(conn->output, &conn->output[offset], conn->output_length - offset);
+    conn->output_length -= offset;
+    return 1;
+}
+
+static
+void requeue_lease(coordinator * c, int lease_index)
+{
+    lease * l = &c->leases[lease_index];
+    for (int i = 0; i < l->count; i++) {
+        coordinator_job * cj = &c->jobs[l->indexes[i]];
+        if (cj->state == job_state_leased && cj->lease_id == l->id) {
+            cj->state = job_state_pending;
+            cj->lease_id = 0;
+            c->pending[c->pending_count++] = l->indexes[i];
+        }
+    }
+    c->leases[lease_index] = c->leases[--c->lease_count];
+}
+
+static
+int find_lease(coordinator * c, long lease_id)
+{
+    for (int i = 0; i < c->lease_count; i++) {
+        if (c->leases[i].id == lease_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static
+void grant_lease(coordinator * c, connection * conn, int max_jobs)
+{
+    if (c->pending_count == 0) {
+        queue_text(conn, (c->done_count == c->job_count) ? "DONE\n" : "WAIT\n");
+        return;
+    }
+    if (c->lease_count == c->lease_capacity) {
+        c->lease_capacity = c->lease_capacity ? c->lease_capacity * 2 : 16;
+        lease * grown = realloc(c->leases, c->lease_capacity * sizeof(lease));
+        if (!grown) {
+            c->lease_capacity = c->lease_count;
+            queue_text(conn, "WAIT\n");
+            return;
+        }
+        c->leases = grown;
+    }
+
+    lease * l = &c->leases[c->lease_count++];
+    l->id = ++c->next_lease_id;
+    l->connection = conn->fd;
+    l->expiry = time(NULL) + c->lease_timeout;
+    l->count = 0;
+    if (max_jobs > LEASE_MAX_JOBS) { max_jobs = LEASE_MAX_JOBS; }
+    while (l->count < max_jobs && c->pending_count > 0) {
+        long index = c->pending[--c->pending_count];
+        c->jobs[index].state = job_state_leased;
+        c->jobs[index].lease_id = l->id;
+        l->indexes[l->count++] = index;
+    }
+    l->remaining = l->count;
+
+    const size_t output_length = conn->output_length;
+    char line[MANIFEST_LINE_MAX + 64];
+    snprintf(line, sizeof(line), "JOBS %ld %d\n", l->id, l->count);
+    int ok = queue_text(conn, line);
+    for (int i = 0; ok && i < l->count; i++) {
+        const batch_job * job = &c->jobs[l->indexes[i]].job;
+        snprintf(line, sizeof(line), "%ld\t%s\t%s\n", job->index, job->input_path, job->output_path);
+        ok = queue_text(conn, line);
+    }
+    if (!ok) {
+        // Take back the part-queued lease; there's room for the WAIT where it was.
+        conn->output_length = output_length;
+        requeue_lease(c, c->lease_count - 1);
+        queue_text(conn, "WAIT\n");
+    }
+}
+
+static
+void acknowledge_job(coordinator * c, long index, int succeeded)
+{
+    if (index < 0 || index >= c->job_count || c->jobs[index].state == job_state_done) {
+        return;
+    }
+    coordinator_job * cj = &c->jobs[index];
+    if (cj->state == job_state_leased) {
+        int lease_index = find_lease(c, cj->lease_id);
+        if (lease_index >= 0 && --c->leases[lease_index].remaining == 0) {
+            c->leases[lease_index] = c->leases[--c->lease_count];
+        }
+    } else {
+        // It had already been given up on and requeued; take it back off the pending stack.
+        for (long i = 0; i < c->pending_count; i++) {
+            if (c->pending[i] == index) {
+                memmove(&c->pending[i], &c->pending[i + 1], (c->pending_count - i - 1) * sizeof(long));
+                c->pending_count--;
+                break;
+            }
+        }
+    }
+    cj->state = job_state_done;
+    c->done_count++;
+    if (!succeeded) {
+        printf("ERROR: conversion of %s failed\n", cj->job.input_path);
+        c->failures++;
+    }
+}
+
+static
+void handle_coordinator_line(coordinator * c, connection * conn, const char * line)
+{
+    long lease_id, index;
+    int max_jobs;
+    char status[8];
+    if (sscanf(line, "LEASE %d", &max_jobs) == 1 && max_jobs > 0) {
+        grant_lease(c, conn, max_jobs);
+    } else if (sscanf(line, "ACK %ld %ld %7s", &lease_id, &index, status) == 3) {
+        acknowledge_job(c, index, strcmp(status, "OK") == 0);
+    }
+}
+
+static
+int listen_on_port(const char * port)
+{
+    struct addrinfo hints = { 0 };
+    struct addrinfo * result;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &result) != 0) {
+        return -1;
+    }
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    const int on = 1;
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, result->ai_addr, result->ai_addrlen) != 0 || listen(fd, 64) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+static
+int run_coordinator(const char * manifest_path, const char * access_log_path, const char * port,
+                    int lease_timeout)
+{
+    coordinator c = { 0 };
+    batch_job * jobs;
+    c.job_count = read_manifest(manifest_path, &jobs);
+    if (c.job_count < 0) {
+        return -2;
+    }
+    if (access_log_path && !prioritize_jobs(jobs, c.job_count, access_log_path)) {
+        free_jobs(jobs, c.job_count);
+        return -2;
+    }
+    c.lease_timeout = lease_timeout;
+    c.jobs = calloc(c.job_count + 1, sizeof(coordinator_job));
+    c.pending = calloc(c.job_count + 1, sizeof(long));
+    if (!c.jobs || !c.pending) {
+        printf("ERROR: memory allocation failed");
+        return -2;
+    }
+    for (long i = 0; i < c.job_count; i++) {
+        c.jobs[i].job = jobs[i];
+        c.pending[c.pending_count++] = c.job_count - 1 - i;
+    }
+    free(jobs);
+
+    const int listener = listen_on_port(port);
+    if (listener < 0) {
+        printf("ERROR: could not listen on port %s\n", port);
+        return -8;
+    }
+
+    connection * connections = NULL;
+    struct pollfd * polls = NULL;
+    int connection_count = 0;
+    while (c.done_count < c.job_count) {
+        struct pollfd * grown_polls = realloc(polls, (connection_count + 1) * sizeof(struct pollfd));
+        if (!grown_polls) { break; }
+        polls = grown_polls;
+        polls[0].fd = listener;
+        polls[0].events = POLLIN;
+        for (int i = 0; i < connection_count; i++) {
+            polls[i + 1].fd = connections[i].fd;
+            polls[i + 1].events = POLLIN | ((connections[i].output_length > 0) ? POLLOUT : 0);
+        }
+        if (poll(polls, connection_count + 1, 1000) < 0 && errno != EINTR) {
+            break;
+        }
+
+        // Take back anything leased out for too long.
+        const time_t now = time(NULL);
+        for (int i = c.lease_count - 1; i >= 0; i--) {
+            if (c.leases[i].expiry <= now) {
+                requeue_lease(&c, i);
+            }
+        }
+
+        // Read from the workers, acting on each complete line, and send them whatever they
+        // have been given. Walk backwards so that dropped connections can be swapped out of
+        // the arrays as we go.
+        for (int i = connection_count - 1; i >= 0; i--) {
+            if (!(polls[i + 1].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR))) {
+                continue;
+            }
+            connection * conn = &connections[i];
+            int ok = 1;
+            if (polls[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t received = recv(conn->fd, &conn->buffer[conn->buffered],
+                                        sizeof(conn->buffer) - conn->buffered - 1, 0);
+                ok = (received > 0) || (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+                if (received > 0) {
+                    conn->buffered += received;
+                    conn->buffer[conn->buffered] = '\0';
+                    char * line = conn->buffer;
+                    char * newline;
+                    while ((newline = strchr(line, '\n'))) {
+                        *newline = '\0';
+                        handle_coordinator_line(&c, conn, line);
+                        line = newline + 1;
+                    }
+                    conn->buffered = strlen(line);
+                    memmove(conn->buffer, line, conn->buffered);
+                }
+            }
+            if (ok) {
+                ok = flush_connection(conn);
+            }
+            if (!ok) {
+                for (int l = c.lease_count - 1; l >= 0; l--) {
+                    if (c.leases[l].connection == conn->fd) {
+                        requeue_lease(&c, l);
+                    }
+                }
+                close(conn->fd);
+                free(conn->output);
+                connections[i] = connections[--connection_count];
+            }
+        }
+
+        if (polls[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            connection * grown = (fd >= 0) ? realloc(connections, (connection_count + 1) * sizeof(connection)) : NULL;
+            if (grown) {
+                set_no_delay(fd);
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                connections = grown;
+                memset(&connections[connection_count], 0, sizeof(connection));
+                connections[connection_count].fd = fd;
+                connection_count++;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    // Closing the connections tells the workers there is nothing left to do.
+    for (int i = 0; i < connection_count; i++) {
+        close(connections[i].fd);
+        free(connections[i].output);
+    }
+    close(listener);
+    free(connections);
+    free(polls);
+    free(c.leases);
+    free(c.pending);
+    for (long i = 0; i < c.job_count; i++) {
+        free(c.jobs[i].job.input_path);
+        free(c.jobs[i].job.output_path);
+    }
+    free(c.jobs);
+
+    if (c.failures > 0) {
+        printf("ERROR: %ld of %ld conversions failed\n", c.failures, c.job_count);
+        return -7;
+    }
+    return (c.done_count == c.job_count) ? 0 : -8;
+}
+
+// Connects to a host:port address. Returns the socket, or -1.
+static
+int connect_to_address(const char * address)
+{
+    const char * colon = strrchr(address, ':');
+    if (!colon) {
+        return -1;
+    }
+    char * host = copy_string(address, colon - address);
+    struct addrinfo hints = { 0 };
+    struct addrinfo * result;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int fd = -1;
+    if (host && getaddrinfo(host, colon + 1, &hints, &result) == 0) {
+        for (struct addrinfo * ai = result; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+            if (fd >= 0) {
+                set_no_delay(fd);
+            }
+        }
+        freeaddrinfo(result);
+    }
+    free(host);
+    return fd;
+}
+
+typedef struct _worker_lease_request {
+    int fd;
+    const char * text;
+    int sent;
+    int ok;
+} worker_lease_request;
+
+static
+void request_next_lease(void * context)
+{
+    worker_lease_request * request = context;
+    request->ok = send_text(request->fd, request->text);
+    request->sent = 1;
+}
+
+static
+int run_worker(const char * address, const dsk2woz2_options * options, const batch_settings * settings)
+{
+    const int fd = connect_to_address(address);
+    FILE * const from_coordinator = (fd >= 0) ? fdopen(fd, "r") : NULL;
+    if (!from_coordinator) {
+        printf("ERROR: could not connect to %s\n", address);
+        return -8;
+    }
+
+    batch_converter * converter = create_batch_converter(options, settings);
+    batch_job * jobs = calloc(LEASE_MAX_JOBS, sizeof(batch_job));
+    if (!converter || !jobs) {
+        printf("ERROR: memory allocation failed");
+        return -2;
+    }
+
+    char line[MANIFEST_LINE_MAX + 64];
+    char lease_request[32];
+    const int lease_size = (converter->slot_count < LEASE_MAX_JOBS) ? converter->slot_count : LEASE_MAX_JOBS;
+    snprintf(lease_request, sizeof(lease_request), "LEASE %d\n", lease_size);
+    int lease_requested = send_text(fd, lease_request);
+    while (lease_requested && fgets(line, sizeof(line), from_coordinator)) {
+        if (strncmp(line, "WAIT", 4) == 0) {
+            sleep(WORKER_WAIT_SECONDS);
+            lease_requested = send_text(fd, lease_request);
+            continue;
+        }
+        long lease_id;
+        int count;
+        if (sscanf(line, "JOBS %ld %d", &lease_id, &count) != 2 || count <= 0 || count > LEASE_MAX_JOBS) {
+            break;  // DONE, or something we don't understand.
+        }
+
+        long job_count = 0;
+        for (int i = 0; i < count && fgets(line, sizeof(line), from_coordinator); i++) {
+            char * index_end;
+            long index = strtol(line, &index_end, 10);
+            if (*index_end == '\t' && parse_job(&jobs[job_count], index_end + 1, index)) {
+                job_count++;
+            }
+        }
+
+        // Ask for the next lease once this one is nearly done, so that it's waiting when the
+        // slots free up, but hasn't been sitting here long enough to expire or to be work an
+        // idle worker could have had instead.
+        worker_lease_request request = { fd, lease_request, 0, 0 };
+        converter->running_low = request_next_lease;
+        converter->running_low_context = &request;
+        convert_jobs(converter, jobs, job_count);
+        converter->running_low = NULL;
+        lease_requested = request.sent ? request.ok : send_text(fd, lease_request);
+
+        // Acknowledge the whole lease in one go. Anything that doesn't fit goes back into the
+        // pool when the lease expires.
+        char acks[LEASE_MAX_JOBS * 64];
+        size_t acks_length = 0;
+        acks[0] = '\0';
+        for (long i = 0; i < job_count; i++) {
+            const int length = snprintf(&acks[acks_length], sizeof(acks) - acks_length, "ACK %ld %ld %s\n",
+                                        lease_id, jobs[i].index, (jobs[i].result == 0) ? "OK" : "FAIL");
+            if (length < 0 || (size_t)length >= sizeof(acks) - acks_length) {
+                acks[acks_length] = '\0';
+                break;
+            }
+            acks_length += length;
+        }
+        for (long i = 0; i < job_count; i++) {
+            free(jobs[i].input_path);
+            free(jobs[i].output_path);
+        }
+        if (acks_length > 0) {
+            send_text(fd, acks);
+        }
+    }
+
+    fclose(from_coordinator);
+    free(jobs);
+    throttle_report(&converter->throttle);
+    destroy_batch_converter(converter);
+    return 0;
+}
+
+//
+// Object store I/O. Inputs and outputs given as s3://bucket/key URLs are fetched and stored
+// over HTTP, on keep-alive connections kept per thread, with requests pipelined so that a
+// batch of small objects moves at the network's pace rather than a round trip at a time.
+// s3://bucket/pack#N is the Nth DSK image packed end to end in one big object, fetched with
+// a ranged GET. The endpoint must be given in AWS_ENDPOINT_URL, and be plain http since
+// there's no TLS here; there's deliberately no default to AWS itself, which would send the
+// credentials' signatures and every image across the internet in the clear. Requests are
+// signed with AWS Signature Version 4 if AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY are set.
+//
+
+#define S3_CONNECTIONS          4       // Per thread
+#define S3_ATTEMPTS             3       // Per connection, before its transfers are given up on
+#define S3_TIMEOUT_MS           30000
+#define S3_RESPONSE_HEADERS_MAX 16384
+#define S3_PACK_MEMBER_SIZE     DSK_IMAGE_SIZE
+
+typedef struct _s3_config {
+    int valid;
+    char * host;                // As sent in the Host header
+    char * address;             // host:port, to connect to
+    const char * access_key;
+    const char * secret_key;
+    const char * session_token;
+    const char * region;
+} s3_config;
+
+static s3_config s3;
+static pthread_once_t s3_config_once = PTHREAD_ONCE_INIT;
+
+enum {
+    s3_state_headers,
+    s3_state_body,
+    s3_state_body_to_close,
+    s3_state_chunk_size,
+    s3_state_chunk_data,
+    s3_state_chunk_end,
+    s3_state_trailers
+};
+
+typedef struct _s3_connection {
+    int connected;
+    int fd;
+    int attempts;
+    int state;                  // Of the response being received
+    char line[S3_RESPONSE_HEADERS_MAX];
+    size_t line_length;
+    uint64_t remaining;         // Body or chunk bytes still to come
+    int close_after;            // The server will close once this response is done
+    int next_send;              // Positions in this connection's share of the transfers
+    size_t send_offset;
+    int next_receive;
+    int count;
+} s3_connection;
+
+// Allocated the first time a thread makes a transfer, and kept open for its next ones. They're
+// closed when the thread exits.
+static _Thread_local s3_connection * s3_connections;
+static pthread_key_t s3_connections_key;
+
+static void s3_release_connections(void * connections);
+
+// A transfer's wire state while it's under way.
+typedef struct _s3_pending {
+    s3_transfer * transfer;
+    char * request;             // The request line and headers
+    size_t request_length;
+    int ranged;
+    int complete;
+    size_t response_capacity;
+} s3_pending;
+
+static
+int is_s3_url(const char * path)
+{
+    return strncmp(path, "s3://", 5) == 0;
+}
+
+static
+int s3_succeeded(const s3_transfer * transfer)
+{
+    return transfer->status >= 200 && transfer->status < 300 && (transfer->body || transfer->response);
+}
+
+//
+// SHA-256 and HMAC-SHA256, for request signing (FIPS 180-4, RFC 2104).
+//
+
+typedef struct _sha256 {
+    uint32_t state[8];
+    uint8_t block[64];
+    uint64_t length;
+} sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTATE(x, n)     (((x) >> (n)) | ((x) << (32 - (n))))
+
+static
+void sha256_compress(sha256 * h, const uint8_t * block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        const uint32_t s0 = SHA256_ROTATE(w[i - 15], 7) ^ SHA256_ROTATE(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const uint32_t s1 = SHA256_ROTATE(w[i - 2], 17) ^ SHA256_ROTATE(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    memcpy(v, h->state, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        const uint32_t s1 = SHA256_ROTATE(v[4], 6) ^ SHA256_ROTATE(v[4], 11) ^ SHA256_ROTATE(v[4], 25);
+        const uint32_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        const uint32_t t1 = v[7] + s1 + choice + sha256_k[i] + w[i];
+        const uint32_t s0 = SHA256_ROTATE(v[0], 2) ^ SHA256_ROTATE(v[0], 13) ^ SHA256_ROTATE(v[0], 22);
+        const uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(&v[1], &v[0], 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + s0 + majority;
+    }
+    for (int i = 0; i < 8; i++) {
+        h->state[i] += v[i];
+    }
+}
+
+static
+void sha256_init(sha256 * h)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(h->state, initial, sizeof(initial));
+    h->length = 0;
+}
+
+static
+void sha256_update(sha256 * h, const void * data, size_t length)
+{
+    const uint8_t * bytes = data;
+    while (length > 0) {
+        const size_t used = h->length % 64;
+        const size_t take = (length < 64 - used) ? length : 64 - used;
+        memcpy(&h->block[used], bytes, take);
+        h->length += take;
+        bytes += take;
+        length -= take;
+        if (used + take == 64) {
+            sha256_compress(h, h->block);
+        }
+    }
+}
+
+static
+void sha256_final(sha256 * h, uint8_t digest[32])
+{
+    const uint64_t bit_length = h->length * 8;
+    uint8_t padding[72] = { 0x80 };
+    const size_t padding_length = ((h->length % 64) < 56 ? 56 : 120) - (h->length % 64);
+    for (int i = 0; i < 8; i++) {
+        padding[padding_length + i] = bit_length >> (56 - i * 8);
+    }
+    sha256_update(h, padding, padding_length + 8);
+    for (int i = 0; i < 32; i++) {
+        digest[i] = h->state[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
+
+static
+void hmac_sha256(uint8_t mac[32], const void * key, size_t key_length, const char * message)
+{
+    uint8_t key_block[64] = { 0 };
+    if (key_length > 64) {
+        sha256 h;
+        sha256_init(&h);
+        sha256_update(&h, key, key_length);
+        sha256_final(&h, key_block);
+    } else {
+        memcpy(key_block, key, key_length);
+    }
+    uint8_t pad[64];
+    sha256 h;
+    for (int i = 0; i < 64; i++) {
+        pad[i] = key_block[i] ^ 0x36;
+    }
+    sha256_init(&h);
+    sha256_update(&h, pad, 64);
+    sha256_update(&h, message, strlen(message));
+    sha256_final(&h, mac);
+    for (int i = 0; i < 64; i++) {
+        pad[i] = key_block[i] ^ 0x5c;
+    }
+    sha256_init(&h);
+    sha256_update(&h, pad, 64);
+    sha256_update(&h, mac, 32);
+    sha256_final(&h, mac);
+}
+
+static
+void hex_string(char * hex, const uint8_t * bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        sprintf(&hex[i * 2], "%02x", bytes[i]);
+    }
+}
+
+//
+// Requests
+//
+
+static
+void s3_load_config(void)
+{
+    const char * endpoint = getenv("AWS_ENDPOINT_URL");
+    s3.region = getenv("AWS_REGION");
+    if (!s3.region || !*s3.region) {
+        s3.region = getenv("AWS_DEFAULT_REGION");
+    }
+    if (!s3.region || !*s3.region) {
+        s3.region = "us-east-1";
+    }
+    s3.access_key = getenv("AWS_ACCESS_KEY_ID");
+    s3.secret_key = getenv("AWS_SECRET_ACCESS_KEY");
+    s3.session_token = getenv("AWS_SESSION_TOKEN");
+    if (!s3.access_key || !*s3.access_key || !s3.secret_key) {
+        s3.access_key = NULL;   // Anonymous
+    }
+
+    if (!endpoint || !*endpoint) {
+        printf("ERROR: set AWS_ENDPOINT_URL to the object store's http:// endpoint\n");
+        return;
+    }
+    if (strncmp(endpoint, "http://", 7) != 0) {
+        printf("ERROR: object store endpoint %s isn't supported (only http:// endpoints are)\n", endpoint);
+        return;
+    }
+    endpoint += 7;
+    const size_t host_length = strcspn(endpoint, "/");
+    s3.host = copy_string(endpoint, host_length);
+    s3.address = malloc(host_length + 4);
+    if (!s3.host || !s3.address) {
+        return;
+    }
+    const char * colon = strrchr(s3.host, ':');
+    sprintf(s3.address, "%s%s", s3.host, colon ? "" : ":80");
+    s3.valid = (pthread_key_create(&s3_connections_key, s3_release_connections) == 0);
+}
+
+// Appends the key to the path, percent-encoded as the signature wants it.
+static
+size_t s3_encode_key(char * path, const char * key, size_t key_length)
+{
+    size_t length = 0;
+    for (size_t i = 0; i < key_length; i++) {
+        const unsigned char c = key[i];
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+            c == '-' || c == '.' || c == '_' || c == '~' || c == '/') {
+            path[length++] = c;
+        } else {
+            length += sprintf(&path[length], "%%%02X", c);
+        }
+    }
+    path[length] = '\0';
+    return length;
+}
+
+// Builds the signed request for a transfer. Returns 0 if the URL is malformed.
+static
+int s3_prepare(s3_pending * pending, time_t now)
+{
+    const char * url = pending->transfer->url + 5;
+    const char * slash = strchr(url, '/');
+    if (!slash || slash == url || slash[1] == '\0') {
+        return 0;
+    }
+    // A #N suffix picks out one image of a pack.
+    const char * key = slash + 1;
+    size_t key_length = strlen(key);
+    long member = -1;
+    const char * hash = strrchr(key, '#');
+    if (hash && hash[1] != '\0' && strspn(hash + 1, "0123456789") == strlen(hash + 1)) {
+        member = strtol(hash + 1, NULL, 10);
+        key_length = hash - key;
+        if (pending->transfer->body || key_length == 0) {
+            return 0;
+        }
+    }
+
+    const size_t bucket_length = slash - url;
+    char * path = malloc(bucket_length + key_length * 3 + 3);
+    if (!path) {
+        return 0;
+    }
+    path[0] = '/';
+    memcpy(&path[1], url, bucket_length);
+    path[bucket_length + 1] = '/';
+    s3_encode_key(&path[bucket_length + 2], key, key_length);
+
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    char date[20];
+    char day[10];
+    strftime(date, sizeof(date), "%Y%m%dT%H%M%SZ", &utc);
+    strftime(day, sizeof(day), "%Y%m%d", &utc);
+    const char * method = pending->transfer->body ? "PUT" : "GET";
+    const char * token = s3.session_token ? s3.session_token : "";
+
+    char authorization[512] = "";
+    if (s3.access_key) {
+        // Sign the method, path and the x-amz headers. The payload isn't hashed; UNSIGNED-PAYLOAD
+        // says so.
+        const size_t canonical_capacity = strlen(path) + strlen(s3.host) + strlen(token) + 256;
+        char * canonical = malloc(canonical_capacity);
+        if (!canonical) {
+            free(path);
+            return 0;
+        }
+        snprintf(canonical, canonical_capacity,
+                 "%s\n%s\n\nhost:%s\nx-amz-content-sha256:UNSIGNED-PAYLOAD\nx-amz-date:%s\n%s%s%s\n"
+                 "host;x-amz-content-sha256;x-amz-date%s\nUNSIGNED-PAYLOAD",
+                 method, path, s3.host, date, *token ? "x-amz-security-token:" : "", token, *token ? "\n" : "",
+                 *token ? ";x-amz-security-token" : "");
+        uint8_t digest[32];
+        char canonical_hash[65];
+        sha256 h;
+        sha256_init(&h);
+        sha256_update(&h, canonical, strlen(canonical));
+        sha256_final(&h, digest);
+        hex_string(canonical_hash, digest, 32);
+        free(canonical);
+
+        char scope[128];
+        char string_to_sign[256];
+        snprintf(scope, sizeof(scope), "%s/%s/s3/aws4_request", day, s3.region);
+        snprintf(string_to_sign, sizeof(string_to_sign), "AWS4-HMAC-SHA256\n%s\n%s\n%s", date, scope, canonical_hash);
+
+        const size_t secret_length = strlen(s3.secret_key);
+        char * secret = malloc(secret_length + 5);
+        if (!secret) {
+            free(path);
+            return 0;
+        }
+        sprintf(secret, "AWS4%s", s3.secret_key);
+        uint8_t key_mac[32];
+        hmac_sha256(key_mac, secret, secret_length + 4, day);
+        free(secret);
+        hmac_sha256(key_mac, key_mac, 32, s3.region);
+        hmac_sha256(key_mac, key_mac, 32, "s3");
+        hmac_sha256(key_mac, key_mac, 32, "aws4_request");
+        hmac_sha256(digest, key_mac, 32, string_to_sign);
+        char signature[65];
+        hex_string(signature, digest, 32);
+        snprintf(authorization, sizeof(authorization),
+                 "Authorization: AWS4-HMAC-SHA256 Credential=%s/%s, SignedHeaders=host;x-amz-content-sha256;x-amz-date%s, Signature=%s\r\n",
+                 s3.access_key, scope, *token ? ";x-amz-security-token" : "", signature);
+    }
+
+    char range[64] = "";
+    if (member >= 0) {
+        const uint64_t first = (uint64_t)member * S3_PACK_MEMBER_SIZE;
+        snprintf(range, sizeof(range), "Range: bytes=%llu-%llu\r\n",
+                 (unsigned long long)first, (unsigned long long)(first + S3_PACK_MEMBER_SIZE - 1));
+    }
+    char content_length[48] = "";
+    if (pending->transfer->body) {
+        snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n", pending->transfer->body_size);
+    }
+
+    const size_t request_capacity = strlen(path) + strlen(s3.host) + strlen(token) + strlen(authorization) + 256;
+    pending->request = malloc(request_capacity);
+    if (pending->request) {
+        pending->request_length = snprintf(pending->request, request_capacity,
+            "%s %s HTTP/1.1\r\nHost: %s\r\nx-amz-date: %s\r\nx-amz-content-sha256: UNSIGNED-PAYLOAD\r\n"
+            "%s%s%s%s%s%s\r\n",
+            method, path, s3.host, date, *token ? "x-amz-security-token: " : "", token, *token ? "\r\n" : "",
+            authorization, range, content_length);
+    }
+    pending->ranged = (member >= 0);
+    free(path);
+    return pending->request != NULL;
+}
+
+//
+// Transfers
+//
+
+static
+void s3_disconnect(s3_connection * c)
+{
+    if (c->connected) {
+        close(c->fd);
+    }
+    c->connected = 0;
+    c->close_after = 0;
+    c->state = s3_state_headers;
+    c->line_length = 0;
+}
+
+static
+void s3_release_connections(void * connections)
+{
+    s3_connection * c = connections;
+    for (int k = 0; k < S3_CONNECTIONS; k++) {
+        s3_disconnect(&c[k]);
+    }
+    free(c);
+}
+
+// Starts the connection over, to resend whatever hasn't been answered yet. Once it has failed
+// too often without getting anywhere, the rest of its transfers are given up on. Returns 0
+// if it gave up.
+static
+int s3_reconnect(s3_connection * c)
+{
+    s3_disconnect(c);
+    c->next_send = c->next_receive;
+    c->send_offset = 0;
+    while (c->next_receive < c->count && c->attempts++ < S3_ATTEMPTS) {
+        c->fd = connect_to_address(s3.address);
+        if (c->fd >= 0) {
+            fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+            c->connected = 1;
+            return 1;
+        }
+    }
+    c->next_receive = c->next_send = c->count;
+    return 0;
+}
+
+// Stores received body bytes, if the response is worth keeping.
+static
+int s3_store(s3_pending * p, const uint8_t * data, size_t length)
+{
+    s3_transfer * t = p->transfer;
+    if (t->status < 200 || t->status >= 300) {
+        return 1;
+    }
+    if (t->response_size + length > p->response_capacity) {
+        size_t capacity = p->response_capacity ? p->response_capacity * 2 : 65536;
+        while (capacity < t->response_size + length) {
+            capacity *= 2;
+        }
+        uint8_t * grown = realloc(t->response, capacity);
+        if (!grown) {
+            return 0;
+        }
+        t->response = grown;
+        p->response_capacity = capacity;
+    }
+    memcpy(&t->response[t->response_size], data, length);
+    t->response_size += length;
+    return 1;
+}
+
+// Winds up the response just received, and moves on to the next.
+static
+void s3_complete(s3_connection * c, s3_pending * p)
+{
+    s3_transfer * t = p->transfer;
+    if (t->status >= 200 && t->status < 300 && !t->body && !t->response) {
+        t->response = malloc(1);    // An empty object is still an object.
+    }
+    if (p->ranged && t->status != 206) {
+        // The server sent the whole pack, not the image.
+        free(t->response);
+        t->response = NULL;
+    }
+    p->complete = 1;
+    c->next_receive++;
+    c->attempts = 0;
+    c->state = s3_state_headers;
+    c->line_length = 0;
+}
+
+// Takes in the response headers, once they're all here. Returns 0 if they're malformed.
+static
+int s3_parse_headers(s3_connection * c, s3_pending * p)
+{
+    s3_transfer * t = p->transfer;
+    c->line[c->line_length] = '\0';
+    int minor_version;
+    if (sscanf(c->line, "HTTP/1.%d %d", &minor_version, &t->status) != 2) {
+        return 0;
+    }
+    int chunked = 0;
+    int has_length = 0;
+    c->close_after = (minor_version == 0);
+    for (char * header = strstr(c->line, "\r\n"); header && header[2] != '\r'; header = strstr(header + 2, "\r\n")) {
+        const char * value = header + 2;
+        if (strncasecmp(value, "Content-Length:", 15) == 0) {
+            c->remaining = strtoull(value + 15, NULL, 10);
+            has_length = 1;
+        } else if (strncasecmp(value, "Transfer-Encoding:", 18) == 0) {
+            chunked = (strstr(value, "chunked") != NULL);
+        } else if (strncasecmp(value, "Connection:", 11) == 0) {
+            const char * option = value + 11 + strspn(value + 11, " ");
+            if (strncasecmp(option, "close", 5) == 0) {
+                c->close_after = 1;
+            } else if (strncasecmp(option, "keep-alive", 10) == 0) {
+                c->close_after = 0;
+            }
+        }
+    }
+    c->line_length = 0;
+    free(t->response);
+    t->response = NULL;
+    t->response_size = 0;
+    p->response_capacity = 0;
+    if (t->status / 100 == 1) {
+        c->state = s3_state_headers;    // Interim; the real one follows.
+    } else if (t->status == 204 || t->status == 304) {
+        s3_complete(c, p);
+    } else if (chunked) {
+        c->state = s3_state_chunk_size;
+    } else if (has_length) {
+        c->state = s3_state_body;
+        if (c->remaining == 0) {
+            s3_complete(c, p);
+        }
+    } else {
+        c->state = s3_state_body_to_close;
+        c->close_after = 1;
+    }
+    return 1;
+}
+
+// Gathers a line, or the whole header block, into the connection's line buffer. Returns how
+// many bytes it took, and sets *done once the terminator is in.
+static
+size_t s3_gather(s3_connection * c, const uint8_t * data, size_t length, const char * terminator, int * done)
+{
+    const size_t terminator_length = strlen(terminator);
+    *done = 0;
+    size_t taken = 0;
+    while (taken < length && !*done) {
+        if (c->line_length + 1 >= sizeof(c->line)) {
+            return 0;
+        }
+        c->line[c->line_length++] = data[taken++];
+        *done = c->line_length >= terminator_length &&
+                memcmp(&c->line[c->line_length - terminator_length], terminator, terminator_length) == 0;
+    }
+    return taken;
+}
+
+// Runs received bytes through the response parser. Returns 0 if the stream is broken.
+static
+int s3_receive(s3_connection * c, s3_pending pending[], int stride, int first, const uint8_t * data, size_t length)
+{
+    while (length > 0) {
+        if (c->next_receive > c->next_send || (c->next_receive == c->next_send && c->send_offset == 0)) {
+            return 0;   // A response to nothing we asked for.
+        }
+        s3_pending * p = &pending[first + c->next_receive * stride];
+        size_t taken = length;
+        int done;
+        switch (c->state) {
+            case s3_state_headers:
+                taken = s3_gather(c, data, length, "\r\n\r\n", &done);
+                if (taken == 0 || (done && !s3_parse_headers(c, p))) {
+                    return 0;
+                }
+                break;
+            case s3_state_body:
+            case s3_state_chunk_data:
+                taken = (length < c->remaining) ? length : c->remaining;
+                if (!s3_store(p, data, taken)) {
+                    return 0;
+                }
+                c->remaining -= taken;
+                if (c->remaining == 0 && c->state == s3_state_body) {
+                    s3_complete(c, p);
+                } else if (c->remaining == 0) {
+                    c->state = s3_state_chunk_end;
+                }
+                break;
+            case s3_state_body_to_close:
+                if (!s3_store(p, data, length)) {
+                    return 0;
+                }
+                break;
+            case s3_state_chunk_size:
+            case s3_state_chunk_end:
+                taken = s3_gather(c, data, length, "\r\n", &done);
+                if (taken == 0) {
+                    return 0;
+                }
+                if (done && c->state == s3_state_chunk_end) {
+                    c->line_length = 0;
+                    c->state = s3_state_chunk_size;
+                } else if (done) {
+                    c->line[c->line_length] = '\0';
+                    c->remaining = strtoull(c->line, NULL, 16);
+                    c->line_length = 0;
+                    c->state = (c->remaining > 0) ? s3_state_chunk_data : s3_state_trailers;
+                }
+                break;
+            case s3_state_trailers:
+                taken = s3_gather(c, data, length, "\r\n", &done);
+                if (taken == 0) {
+                    return 0;
+                }
+                if (done && c->line_length == 2) {
+                    s3_complete(c, p);
+                } else if (done) {
+                    c->line_length = 0;
+                }
+                break;
+        }
+        data += taken;
+        length -= taken;
+    }
+    return 1;
+}
+
+// Sends as much of this connection's outstanding requests as the socket will take.
+static
+int s3_send(s3_connection * c, s3_pending pending[], int stride, int first)
+{
+    while (c->next_send < c->count) {
+        s3_pending * p = &pending[first + c->next_send * stride];
+        const int in_request = c->send_offset < p->request_length;
+        const uint8_t * data = in_request ? (const uint8_t *)p->request + c->send_offset :
+                                            p->transfer->body + (c->send_offset - p->request_length);
+        const size_t length = in_request ? p->request_length - c->send_offset :
+                                           p->transfer->body_size - (c->send_offset - p->request_length);
+        if (length > 0) {
+            const ssize_t sent = send(c->fd, data, length, 0);
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return 1;
+            }
+            if (sent <= 0) {
+                return 0;
+            }
+            c->send_offset += sent;
+        }
+        if (c->send_offset == p->request_length + (p->transfer->body ? p->transfer->body_size : 0)) {
+            c->next_send++;
+            c->send_offset = 0;
+        }
+    }
+    return 1;
+}
+
+// Performs the transfers, spread over this thread's connections and pipelined on each. Each
+// transfer's status is set, to 0 if it got no response at all. A GET's object is left in its
+// response, for the caller to free, if the status was 2xx.
+static
+void s3_perform(s3_transfer transfers[], int count)
+{
+    pthread_once(&s3_config_once, s3_load_config);
+    if (!s3_connections && s3.valid) {
+        s3_connections = calloc(S3_CONNECTIONS, sizeof(s3_connection));
+        if (s3_connections) {
+            pthread_setspecific(s3_connections_key, s3_connections);
+        }
+    }
+    s3_pending * pending = s3_connections ? calloc(count, sizeof(s3_pending)) : NULL;
+    int valid_count = 0;
+    const time_t now = time(NULL);
+    for (int i = 0; i < count; i++) {
+        transfers[i].response = NULL;
+        transfers[i].response_size = 0;
+        transfers[i].status = 0;
+        if (pending && s3.valid) {
+            pending[valid_count].transfer = &transfers[i];
+            if (s3_prepare(&pending[valid_count], now)) {
+                valid_count++;
+            }
+        }
+    }
+
+    // Transfer i goes to connection i % stride.
+    const int stride = (valid_count < S3_CONNECTIONS) ? valid_count : S3_CONNECTIONS;
+    for (int k = 0; k < stride; k++) {
+        s3_connection * c = &s3_connections[k];
+        c->count = (valid_count - k + stride - 1) / stride;
+        c->next_send = c->next_receive = 0;
+        c->send_offset = 0;
+        c->attempts = 0;
+        if (!c->connected) {
+            s3_reconnect(c);
+        }
+    }
+
+    uint8_t * buffer = malloc(65536);
+    for (;;) {
+        struct pollfd fds[S3_CONNECTIONS];
+        int fd_count = 0;
+        for (int k = 0; k < stride; k++) {
+            s3_connection * c = &s3_connections[k];
+            const int active = c->next_receive < c->count;
+            fds[k].fd = active ? c->fd : -1;
+            fds[k].events = POLLIN | ((c->next_send < c->count) ? POLLOUT : 0);
+            fds[k].revents = 0;
+            fd_count += active;
+        }
+        if (fd_count == 0 || !buffer) {
+            break;
+        }
+        const int ready = poll(fds, stride, S3_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        for (int k = 0; k < stride; k++) {
+            s3_connection * c = &s3_connections[k];
+            if (fds[k].fd < 0 || (ready > 0 && fds[k].revents == 0)) {
+                continue;
+            }
+            int healthy = (ready > 0);
+            if (healthy && (fds[k].revents & POLLOUT)) {
+                healthy = s3_send(c, pending, stride, k);
+            }
+            if (healthy && (fds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+                const ssize_t received = recv(c->fd, buffer, 65536, 0);
+                if (received > 0) {
+                    healthy = s3_receive(c, pending, stride, k, buffer, received);
+                    if (healthy && c->close_after && c->state == s3_state_headers) {
+                        healthy = 0;    // Answered, but the server's done with the connection.
+                    }
+                    if (c->next_receive > c->next_send) {
+                        healthy = 0;    // Answered before we'd finished sending; start afresh.
+                    }
+                } else if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    if (c->state == s3_state_body_to_close && c->next_receive < c->next_send) {
+                        s3_complete(c, &pending[k + c->next_receive * stride]);
+                    }
+                    healthy = 0;
+                }
+            }
+            if (!healthy) {
+                s3_reconnect(c);
+            }
+        }
+    }
+
+    free(buffer);
+    for (int i = 0; pending && i < valid_count; i++) {
+        s3_transfer * t = pending[i].transfer;
+        if (!pending[i].complete) {
+            t->status = 0;
+        }
+        if (t->body || t->status < 200 || t->status >= 300) {
+            free(t->response);
+            t->response = NULL;
+        }
+        free(pending[i].request);
+    }
+    free(pending);
+}
+
+#endif // DSK2WOZ2_NO_MAIN
+
+//
+// Conversion API routines
+//
+
+void dsk2woz2_default_options(dsk2woz2_options * options)
+{
+    options->sector_format = dsk2woz2_sector_format_dos_3_3;
+    for (int t = 0; t < TRACKS_PER_DISK; t++) {
+        options->track_order[t] = t;
+    }
+}
+
+// The track order comes from the caller, and every track must appear in it exactly once.
+static
+int valid_track_order(const dsk2woz2_options * options)
+{
+    int seen[TRACKS_PER_DISK] = { 0 };
+    for (int i = 0; i < TRACKS_PER_DISK; i++) {
+        const int t = options->track_order[i];
+        if (t < 0 || t >= TRACKS_PER_DISK || seen[t]) {
+            return 0;
+        }
+        seen[t] = 1;
+    }
+    return 1;
+}
+
+// Converts the DSK image into the caller's buffer, which needs at least WOZ_IMAGE_SIZE
+// bytes. Returns the size of the WOZ image, or 0 if either buffer is the wrong size or the
+// options' track order isn't an ordering of all the tracks.
+size_t dsk2woz2_convert(uint8_t * woz, size_t woz_capacity,
+                        const uint8_t * dsk, size_t dsk_size,
+                        const dsk2woz2_options * options)
+{
+    if (woz_capacity < WOZ_IMAGE_SIZE || dsk_size != DSK_IMAGE_SIZE || !valid_track_order(options)) {
+        return 0;
+    }
+    return assemble_woz(woz, dsk, encode_dsk_track, 1, 1, 1, options);
+}
+
+// Converts a NIB image into the caller's buffer, which needs at least WOZ_IMAGE_SIZE bytes.
+// The nibbles go into the BITS as they are, 8 bits apiece; NIB images don't record which
+// of them were 10-bit sync bytes, so the WOZ image is marked neither cleaned nor writeable.
+// Returns the size of the WOZ image, or 0 if either buffer is the wrong size or the track
+// order is invalid.
+size_t dsk2woz2_convert_nib(uint8_t * woz, size_t woz_capacity,
+                            const uint8_t * nib, size_t nib_size,
+                            const dsk2woz2_options * options)
+{
+    if (woz_capacity < WOZ_IMAGE_SIZE || nib_size != NIB_IMAGE_SIZE || !valid_track_order(options)) {
+        return 0;
+    }
+    return assemble_woz(woz, nib, copy_nib_track, 0, 0, 0, options);
+}
+
+static
+uint32_t encode_dsk_track(uint8_t * bits, const uint8_t * dsk, int track_number, const dsk2woz2_options * options)
+{
+    return (uint32_t)encode_bits_for_track(bits, &dsk[track_number * BYTES_PER_TRACK], track_number,
+                                           options->sector_format, NULL);
+}
+
+static
+uint32_t copy_nib_track(uint8_t * bits, const uint8_t * nib, int track_number, const dsk2woz2_options * options)
+{
+    (void)options;
+    memcpy(bits, &nib[track_number * NIB_TRACK_SIZE], NIB_TRACK_SIZE);
+    return NIB_TRACK_SIZE * 8;
+}
+
+static
+void write_woz_header(uint8_t * woz)
+{
+    woz[0] = 'W'; woz[1] = 'O'; woz[2] = 'Z'; woz[3] = '2';   // 'WOZ2' magic number
+    woz[4] = 0xFF;                                 // Marker to ensure high bits present
+    woz[5] = '\n'; woz[6] = '\r'; woz[7] = '\n';   // LF CR LF to ensure no text transforms
+}
+
+static
+size_t assemble_woz(uint8_t * woz, const uint8_t * source, track_filler fill_track,
+                    int cleaned, int boot_sector_format, int include_writ,
+                    const dsk2woz2_options * options)
+{
+    const uint64_t trace_start = trace_begin();
+    uint64_t trace_step = trace_begin();
+
+    // Emit the header. Leave the CRC slot empty; will write that last.
+    write_woz_header(woz);
+
+    // Write the chunks in order. The tracks are written directly into their BITS blocks
+    // in the TRKS chunk, and the WRIT chunk is then computed from the bits in place.
+    const uint8_t * track_bits[TRACKS_PER_DISK];
+    uint32_t valid_bits_per_track;
+    size_t output_index = WOZ_HEADER_SIZE;
+    output_index += write_info_chunk(&woz[output_index], cleaned, boot_sector_format);
+    output_index += write_tmap_chunk(&woz[output_index]);
+    trace_end(trace_name_assemble, trace_step, -1);
+    output_index += write_trks_chunk(&woz[output_index], track_bits, source, fill_track, options,
+                                     &valid_bits_per_track);
+    if (include_writ) {
+        output_index += write_writ_chunk(&woz[output_index], track_bits, valid_bits_per_track);
+    }
+
+    // Compute the overall CRC of everthing after the header, and write it in.
+    trace_step = trace_begin();
+    uint32_t crc = crc32(0, &woz[WOZ_HEADER_SIZE], output_index - WOZ_HEADER_SIZE);
+    write_uint32(&woz[8], crc);
+    trace_end(trace_name_crc, trace_step, -1);
+    trace_end(trace_name_convert, trace_start, -1);
+
+    return output_index;
+}
+
+//
+// Input format detection routines
+//
+
+// Returns the sector of a DSK image stored in image_order, where the sector number is in
+// the numbering of the given DOS 3.3 or ProDOS file system.
+static
+const uint8_t * dsk_sector(const uint8_t * dsk, int track, int sector,
+                           dsk2woz2_sector_format numbering, dsk2woz2_sector_format image_order)
+{
+    int physical_sector = 0;
+    while (logical_sector_for_physical(physical_sector, numbering) != sector) {
+        physical_sector++;
+    }
+    return &dsk[(track * BYTES_PER_TRACK) +
+                (logical_sector_for_physical(physical_sector, image_order) * BYTES_PER_SECTOR)];
+}
+
+// Does the first half of block 2 look like a ProDOS volume directory key block?
+static
+int has_prodos_volume_directory(const uint8_t * dsk, dsk2woz2_sector_format image_order)
+{
+    const uint8_t * block = dsk_sector(dsk, 0, 4, dsk2woz2_sector_format_prodos, image_order);
+    return block[0] == 0 && block[1] == 0 && (block[4] & 0xF0) == 0xF0 &&
+           block[0x23] == 0x27 && block[0x24] == 0x0D;
+}
+
+// Does the VTOC lead to a DOS 3.3 catalog whose sectors chain the way INIT lays them out?
+// The first catalog sector lands in the same place in either order, so it's the link from
+// there to the next one that tells the orders apart.
+static
+int has_dos_catalog(const uint8_t * dsk, dsk2woz2_sector_format image_order)
+{
+    const uint8_t * vtoc = dsk_sector(dsk, DOS_CATALOG_TRACK, 0, dsk2woz2_sector_format_dos_3_3, image_order);
+    if (vtoc[1] >= TRACKS_PER_DISK || vtoc[2] >= SECTORS_PER_TRACK ||
+        vtoc[0x34] != TRACKS_PER_DISK || vtoc[0x35] != SECTORS_PER_TRACK) {
+        return 0;
+    }
+    const uint8_t * first = dsk_sector(dsk, vtoc[1], vtoc[2], dsk2woz2_sector_format_dos_3_3, image_order);
+    if (first[1] >= TRACKS_PER_DISK || first[2] >= SECTORS_PER_TRACK || first[2] == 0) {
+        return 0;
+    }
+    const uint8_t * second = dsk_sector(dsk, first[1], first[2], dsk2woz2_sector_format_dos_3_3, image_order);
+    return second[1] == first[1] && second[2] == first[2] - 1;
+}
+
+// Assume the standard DOS 3.3 sector format unless the name ends in .po, which indicates
+// ProDOS sectoring. (The sector format of the image is not necessarily the same as the
+// formatting of the disk.)
+static
+dsk2woz2_sector_format sector_format_for_path(const char * path)
+{
+    if (path && strlen(path) > 3 &&
+        strncmp(&(path[strlen(path)-3]), ".po", 3) == 0) {
+        return dsk2woz2_sector_format_prodos;
+    }
+    return dsk2woz2_sector_format_dos_3_3;
+}
+
+// Works out a DSK image's sector order from its file system if it can, since extensions
+// are often wrong, and from its name otherwise.
+static
+dsk2woz2_sector_format detect_sector_format(const uint8_t * dsk, const char * name)
+{
+    const dsk2woz2_sector_format orders[] = { dsk2woz2_sector_format_dos_3_3, dsk2woz2_sector_format_prodos };
+    for (int i = 0; i < 2; i++) {
+        if (has_prodos_volume_directory(dsk, orders[i])) {
+            return orders[i];
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (has_dos_catalog(dsk, orders[i])) {
+            return orders[i];
+        }
+    }
+    return sector_format_for_path(name);
+}
+
+// Identifies the image. name (which may be NULL) is only used as a hint for the sector order
+// of a DSK image whose file system isn't recognized. Returns 0 if the format is unknown.
+int dsk2woz2_probe_image(dsk2woz2_probe * probe, const uint8_t * image, size_t image_size, const char * name)
+{
+    memset(probe, 0, sizeof(dsk2woz2_probe));
+    probe->size = image_size;
+
+    if (image_size >= WOZ_HEADER_SIZE && memcmp(image, "WOZ2\xFF\n\r\n", 8) == 0) {
+        probe->format = dsk2woz2_format_woz2;
+    } else if (image_size >= WOZ_HEADER_SIZE && memcmp(image, "WOZ1\xFF\n\r\n", 8) == 0) {
+        probe->format = dsk2woz2_format_woz1;
+    } else if (image_size >= 2 && image[0] == 0x1F && image[1] == 0x8B) {
+        probe->format = dsk2woz2_format_gzip;
+    } else if (image_size >= 4 && memcmp(image, "PK\x03\x04", 4) == 0) {
+        probe->format = dsk2woz2_format_zip;
+    } else if (image_size >= 64 && memcmp(image, "2IMG", 4) == 0) {
+        // 2MG: a 64-byte header, then the disk in DOS order (0), ProDOS order (1) or NIB (2).
+        const uint32_t image_format = read_uint32(&image[12]);
+        const uint32_t data_offset = read_uint32(&image[24]);
+        const uint32_t data_length = read_uint32(&image[28]);
+        if (data_offset <= image_size && data_length <= image_size - data_offset) {
+            probe->offset = data_offset;
+            probe->size = data_length;
+            if (image_format <= 1 && data_length == DSK_IMAGE_SIZE) {
+                probe->format = dsk2woz2_format_dsk;
+                probe->sector_format = (image_format == 1) ? dsk2woz2_sector_format_prodos : dsk2woz2_sector_format_dos_3_3;
+            } else if (image_format == 2 && data_length == NIB_IMAGE_SIZE) {
+                probe->format = dsk2woz2_format_nib;
+            }
+        }
+    } else if (image_size == DSK_IMAGE_SIZE) {
+        probe->format = dsk2woz2_format_dsk;
+        probe->sector_format = detect_sector_format(image, name);
+    } else if (image_size == NIB_IMAGE_SIZE) {
+        probe->format = dsk2woz2_format_nib;
+    }
+    return probe->format != dsk2woz2_format_unknown;
+}
+
+// Converts a probed DSK or NIB image into the caller's buffer, which needs at least
+// WOZ_IMAGE_SIZE bytes. The probe's sector order overrides the options'. Returns the size of
+// the WOZ image, or 0 if the image isn't one that converts (WOZ images pass through as is).
+size_t dsk2woz2_convert_image(uint8_t * woz, size_t woz_capacity, const uint8_t * image,
+                              const dsk2woz2_probe * probe, const dsk2woz2_options * options)
+{
+    dsk2woz2_options probed_options = *options;
+    switch (probe->format) {
+        case dsk2woz2_format_dsk:
+            probed_options.sector_format = probe->sector_format;
+            return dsk2woz2_convert(woz, woz_capacity, &image[probe->offset], probe->size, &probed_options);
+        case dsk2woz2_format_nib:
+            return dsk2woz2_convert_nib(woz, woz_capacity, &image[probe->offset], probe->size, options);
+        case dsk2woz2_format_woz1:
+            return dsk2woz2_upgrade_woz1(woz, woz_capacity, &image[probe->offset], probe->size);
+        default:
+            return 0;
+    }
+}
+
+// Returns how big a buffer dsk2woz2_convert_image needs for the probed image, or 0 if it
+// can't convert it.
+size_t dsk2woz2_woz_capacity_for_image(const uint8_t * image, const dsk2woz2_probe * probe)
+{
+    switch (probe->format) {
+        case dsk2woz2_format_dsk:
+        case dsk2woz2_format_nib:
+            return WOZ_IMAGE_SIZE;
+        case dsk2woz2_format_woz1:
+            return dsk2woz2_upgrade_woz1(NULL, 0, &image[probe->offset], probe->size);
+        default:
+            return 0;
+    }
+}
+
+//
+// WOZ1 upgrade routines
+//
+
+// Converts a WOZ1 image into the caller's buffer. Each WOZ1 track record (6646 bytes of
+// bitstream, then its byte and bit counts) is copied into a 13 block WOZ2 BITS slot, and
+// TMAP and any META come across as they are. The CRCs of the track bits, which the WRIT
+// chunk needs, are folded into the file CRC rather than the bits being read twice.
+// Returns the size of the WOZ2 image, or 0 if the WOZ1 image is malformed or the buffer
+// is too small. If woz is NULL, just returns the size the WOZ2 image will be.
+size_t dsk2woz2_upgrade_woz1(uint8_t * woz, size_t woz_capacity, const uint8_t * woz1, size_t woz1_size)
+{
+    uint32_t info_length, tmap_length, trks_length, meta_length = 0;
+    if (woz1_size < WOZ_HEADER_SIZE || memcmp(woz1, "WOZ1", 4) != 0) {
+        return 0;
+    }
+    const uint8_t * info = find_chunk(woz1, woz1_size, "INFO", &info_length);
+    const uint8_t * tmap = find_chunk(woz1, woz1_size, "TMAP", &tmap_length);
+    const uint8_t * trks = find_chunk(woz1, woz1_size, "TRKS", &trks_length);
+    const uint8_t * meta = find_chunk(woz1, woz1_size, "META", &meta_length);
+    const int track_count = trks ? (int)(trks_length / WOZ1_TRACK_SIZE) : 0;
+    if (!info || info_length < 37 || info[1] != 1 || !tmap || tmap_length < 160 ||
+        track_count == 0 || track_count > 160) {
+        return 0;   // Only 5.25" disks have WOZ1 track records we understand.
+    }
+
+    // Each track's write goes to the first quarter track it's mapped to, preferring the x.00.
+    int quarter_tracks[160];
+    int write_count = 0;
+    for (int i = 0; i < track_count; i++) {
+        quarter_tracks[i] = -1;
+        for (int q = 0; q < 160; q++) {
+            if (tmap[q] == i && (quarter_tracks[i] < 0 || (q % 4 == 0 && quarter_tracks[i] % 4 != 0))) {
+                quarter_tracks[i] = q;
+            }
+        }
+        if (quarter_tracks[i] >= 0) {
+            write_count++;
+        }
+    }
+
+    const size_t trks_size = 8 + (160 * 8) + (track_count * BITS_TRACK_SIZE);
+    const size_t writ_size = 8 + (write_count * 20);
+    const size_t woz_size = WOZ_HEADER_SIZE + WOZ_INFO_CHUNK_SIZE + WOZ_TMAP_CHUNK_SIZE +
+                            trks_size + writ_size + (meta ? 8 + meta_length : 0);
+    if (!woz) {
+        return woz_size;
+    }
+    if (woz_capacity < woz_size) {
+        return 0;
+    }
+    const uint64_t trace_start = trace_begin();
+
+    // INFO keeps the WOZ1 image's flags and creator, and gains the version 2 fields.
+    write_woz_header(woz);
+    size_t output_index = WOZ_HEADER_SIZE;
+    uint8_t * new_info = &woz[output_index + 8];
+    output_index += write_info_chunk(&woz[output_index], info[4], 0);
+    write_uint8(&new_info[2], info[2]);     // Write protected
+    write_uint8(&new_info[3], info[3]);     // Synchronized
+    memcpy(&new_info[5], &info[5], 32);     // Creator
+
+    uint8_t * new_tmap = begin_chunk(&woz[output_index], "TMAP", 160);
+    memcpy(new_tmap, tmap, 160);
+    output_index += WOZ_TMAP_CHUNK_SIZE;
+
+    // Fill in the TRK table first, so everything up to the BITS can be checksummed in one go.
+    uint8_t * data = begin_chunk(&woz[output_index], "TRKS", trks_size - 8);
+    uint32_t bit_counts[160];
+    for (int i = 0; i < track_count; i++) {
+        bit_counts[i] = read_uint16(&trks[(i * WOZ1_TRACK_SIZE) + WOZ1_BITSTREAM_SIZE + 2]);
+        if ((bit_counts[i] + 7) / 8 > WOZ1_BITSTREAM_SIZE) {
+            return 0;
+        }
+        write_uint16(&data[i * 8], 3 + (i * BITS_BLOCKS_PER_TRACK));
+        write_uint16(&data[(i * 8) + 2], BITS_BLOCKS_PER_TRACK);
+        write_uint32(&data[(i * 8) + 4], bit_counts[i]);
+    }
+    uint32_t crc = crc32(0, &woz[WOZ_HEADER_SIZE], (size_t)(&data[1280] - &woz[WOZ_HEADER_SIZE]));
+
+    // Copy the bits. begin_chunk zeroed the rest of each slot, whose CRC is simply shifted.
+    uint32_t track_crcs[160];
+    for (int i = 0; i < track_count; i++) {
+        uint8_t * bits = &data[1280 + (i * BITS_TRACK_SIZE)];
+        const size_t byte_count = (bit_counts[i] + 7) / 8;
+        memcpy(bits, &trks[i * WOZ1_TRACK_SIZE], byte_count);
+        track_crcs[i] = crc32(0, bits, byte_count);
+        crc = crc32_combine(crc, track_crcs[i], byte_count);
+        crc = crc32_extend_zeros(crc, BITS_TRACK_SIZE - byte_count);
+    }
+    output_index += trks_size;
+
+    // Write every track whole, leaving only its leading run of 10-bit syncs alone.
+    const size_t writ_index = output_index;
+    uint8_t * writ = begin_chunk(&woz[output_index], "WRIT", writ_size - 8);
+    for (int i = 0; i < track_count; i++) {
+        if (quarter_tracks[i] >= 0) {
+            const uint8_t * bits = &data[1280 + (i * BITS_TRACK_SIZE)];
+            const uint32_t leader_bits = count_leader_sync_bits(bits, bit_counts[i]);
+            writ += write_writ_entry(writ, quarter_tracks[i], track_crcs[i], leader_bits,
+                                     bit_counts[i] - leader_bits);
+        }
+    }
+    output_index += writ_size;
+
+    if (meta) {
+        memcpy(&woz[output_index], meta - 8, 8 + meta_length);
+        output_index += 8 + meta_length;
+    }
+    crc = crc32(crc, &woz[writ_index], output_index - writ_index);
+    write_uint32(&woz[8], crc);
+    trace_end(trace_name_convert, trace_start, -1);
+    return output_index;
+}
+
+// Returns how many bits at the start of the track are 10-bit sync nibbles.
+static
+uint32_t count_leader_sync_bits(const uint8_t * bits, uint32_t bit_count)
+{
+    uint32_t index = 0;
+    while (index + 10 <= bit_count) {
+        for (int b = 0; b < 10; b++) {
+            const int bit = (bits[(index + b) >> 3] >> (7 - ((index + b) & 7))) & 1;
+            if (bit != (b < 8)) {
+                return index;
+            }
+        }
+        index += 10;
+    }
+    return index;
+}
+
+//
+// INFO editing routines
+//
+
+void dsk2woz2_default_info_edit(dsk2woz2_info_edit * edit)
+{
+    edit->write_protected = -1;
+    edit->compatible_hardware = -1;
+    edit->required_ram = -1;
+    edit->creator = NULL;
+}
+
+// Applies the edit to the image's INFO chunk. Since the CRC is linear, the new CRC is the old
+// one XORed with the CRC of the changed bytes' difference, carried through the bytes after
+// them as zeros. A CRC of 0 means none was calculated, and is left that way. Returns 0 if
+// the image isn't WOZ2 or has no INFO chunk.
+int dsk2woz2_edit_info(uint8_t * woz, size_t woz_size, const dsk2woz2_info_edit * edit)
+{
+    uint32_t info_length;
+    if (woz_size < WOZ_HEADER_SIZE || memcmp(woz, "WOZ2", 4) != 0) {
+        return 0;
+    }
+    uint8_t * info = (uint8_t *)find_chunk(woz, woz_size, "INFO", &info_length);
+    if (!info || info_length < 46) {
+        return 0;
+    }
+
+    uint8_t original[46];
+    memcpy(original, info, sizeof(original));
+    if (edit->write_protected >= 0) {
+        write_uint8(&info[2], edit->write_protected ? 1 : 0);
+    }
+    if (edit->creator) {
+        write_utf8(&info[5], edit->creator, 32);
+    }
+    if (edit->compatible_hardware >= 0) {
+        write_uint16(&info[40], (uint16_t)edit->compatible_hardware);
+    }
+    if (edit->required_ram >= 0) {
+        write_uint16(&info[42], (uint16_t)edit->required_ram);
+    }
+
+    // Find the range that changed and XOR out the difference.
+    size_t first = 0;
+    size_t last = sizeof(original);
+    while (first < last && info[first] == original[first]) {
+        first++;
+    }
+    while (last > first && info[last - 1] == original[last - 1]) {
+        last--;
+    }
+    const uint32_t old_crc = read_uint32(&woz[8]);
+    if (first == last || old_crc == 0) {
+        return 1;
+    }
+    const size_t bytes_after = woz_size - (size_t)(&info[last] - woz);
+    write_uint32(&woz[8], crc32_patch(old_crc, &original[first], &info[first], last - first, bytes_after));
+    return 1;
+}
+
+// Every byte is checksummed once: the CRCs of the tracks the WRIT entries cover are worked
+// out first, and then combined into the file CRC in place of going over those bytes again.
+int dsk2woz2_verify_woz(const uint8_t * woz, size_t woz_size)
+{
+    uint32_t tmap_length, trks_length, writ_length;
+    if (woz_size < WOZ_HEADER_SIZE || memcmp(woz, "WOZ2\xFF\n\r\n", 8) != 0) {
+        return 0;
+    }
+    const uint8_t * tmap = find_chunk(woz, woz_size, "TMAP", &tmap_length);
+    const uint8_t * trks = find_chunk(woz, woz_size, "TRKS", &trks_length);
+    const uint8_t * writ = find_chunk(woz, woz_size, "WRIT", &writ_length);
+    if (writ && (!tmap || tmap_length < 160 || !trks || trks_length < 160 * 8)) {
+        return 0;
+    }
+
+    // Checksum each track that a WRIT entry refers to, noting them in file order.
+    uint32_t track_crcs[160];
+    size_t track_offsets[160];
+    size_t track_lengths[160];
+    int ordered[160];
+    int ordered_count = 0;
+    uint8_t checked[160] = { 0 };
+    size_t index = 0;
+    while (writ && index + 8 <= writ_length) {
+        if (writ[index] >= tmap_length) {
+            return 0;   // A quarter track past the end of the TMAP
+        }
+        const int t = tmap[writ[index]];
+        const size_t entry_length = 8 + (12 * writ[index + 1]);   // 8 bytes, then 12 per command
+        if (t >= 160 || index + entry_length > writ_length) {
+            return 0;
+        }
+        if (!checked[t]) {
+            track_offsets[t] = read_uint16(&trks[t * 8]) * (size_t)BITS_BLOCK_SIZE;
+            track_lengths[t] = (read_uint32(&trks[(t * 8) + 4]) + 7) / 8;
+            if (track_offsets[t] < WOZ_HEADER_SIZE || track_offsets[t] > woz_size ||
+                track_lengths[t] > woz_size - track_offsets[t]) {
+                return 0;
+            }
+            track_crcs[t] = crc32(0, &woz[track_offsets[t]], track_lengths[t]);
+            checked[t] = 1;
+            int i = ordered_count++;
+            for (; i > 0 && track_offsets[ordered[i - 1]] > track_offsets[t]; i--) {
+                ordered[i] = ordered[i - 1];
+            }
+            ordered[i] = t;
+        }
+        if (read_uint32(&writ[index + 4]) != track_crcs[t]) {
+            return 0;
+        }
+        index += entry_length;
+    }
+
+    // A header CRC of 0 means none was calculated.
+    const uint32_t header_crc = read_uint32(&woz[8]);
+    if (header_crc == 0) {
+        return 1;
+    }
+    uint32_t crc = 0;
+    size_t position = WOZ_HEADER_SIZE;
+    for (int i = 0; i < ordered_count; i++) {
+        const int t = ordered[i];
+        if (track_offsets[t] < position) {
+            // Overlapping tracks; not worth being clever about.
+            return header_crc == crc32(0, &woz[WOZ_HEADER_SIZE], woz_size - WOZ_HEADER_SIZE);
+        }
+        crc = crc32(crc, &woz[position], track_offsets[t] - position);
+        crc = crc32_combine(crc, track_crcs[t], track_lengths[t]);
+        position = track_offsets[t] + track_lengths[t];
+    }
+    crc = crc32(crc, &woz[position], woz_size - position);
+    return header_crc == crc;
+}
+
+const char * dsk2woz2_format_name(dsk2woz2_format format)
+{
+    switch (format) {
+        case dsk2woz2_format_dsk: return "DSK";
+        case dsk2woz2_format_nib: return "NIB";
+        case dsk2woz2_format_woz1: return "WOZ1";
+        case dsk2woz2_format_woz2: return "WOZ2";
+        case dsk2woz2_format_gzip: return "gzip";
+        case dsk2woz2_format_zip: return "zip";
+        default: return "unknown";
+    }
+}
+
+//
+// Asynchronous conversion queue routines
+//
+
+struct _dsk2woz2_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;          // Workers wait here for submissions
+    pthread_cond_t work_completed;          // Blocking reapers wait here for completions
+    dsk2woz2_request * pending_head;
+    dsk2woz2_request * pending_tail;
+    dsk2woz2_request * completed_head;
+    dsk2woz2_request * completed_tail;
+    int pending_count;
+    int converting_count;                   // Taken by a worker, not yet completed
+    int completed_count;
+    int completion_signaled;                // Completion fd is readable
+    int completion_fd[2];                   // eventfd (both ends the same) or a pipe
+    int shutting_down;
+    int worker_count;
+    pthread_t workers[];
+};
+
+// Starts worker_count conversion threads. Returns NULL on failure, or if worker_count is less
+// than 1 (a queue with no workers would never complete anything).
+dsk2woz2_queue * dsk2woz2_queue_create(int worker_count)
+{
+    if (worker_count < 1) { return NULL; }
+    dsk2woz2_queue * queue = calloc(1, sizeof(dsk2woz2_queue) + (worker_count * sizeof(pthread_t)));
+    if (!queue) { return NULL; }
+
+#ifdef __linux__
+    queue->completion_fd[0] = queue->completion_fd[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (queue->completion_fd[0] < 0) {
+        free(queue);
+        return NULL;
+    }
+#else
+    if (pipe(queue->completion_fd) != 0) {
+        free(queue);
+        return NULL;
+    }
+#endif
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->work_available, NULL);
+    pthread_cond_init(&queue->work_completed, NULL);
+
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&queue->workers[i], NULL, queue_worker, queue) != 0) {
+            dsk2woz2_queue_destroy(queue);
+            return NULL;
+        }
+        queue->worker_count++;
+    }
+    return queue;
+}
+
+// The returned descriptor is readable while completions are waiting to be reaped. Don't
+// read from it; dsk2woz2_queue_reap takes care of that.
+int dsk2woz2_queue_fd(dsk2woz2_queue * queue)
+{
+    return queue->completion_fd[0];
+}
+
+// Submits a batch of requests under a single lock acquisition.
+void dsk2woz2_queue_submit(dsk2woz2_queue * queue, dsk2woz2_request * requests[], int count)
+{
+    if (count <= 0) { return; }
+    for (int i = 0; i < count; i++) {
+        requests[i]->woz_size = 0;
+        requests[i]->next = (i + 1 < count) ? requests[i + 1] : NULL;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->pending_tail) {
+        queue->pending_tail->next = requests[0];
+    } else {
+        queue->pending_head = requests[0];
+    }
+    queue->pending_tail = requests[count - 1];
+    queue->pending_count += count;
+    trace_counter(trace_name_queue_pending, queue->pending_count);
+    if (count == 1) {
+        pthread_cond_signal(&queue->work_available);
+    } else {
+        pthread_cond_broadcast(&queue->work_available);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Harvests up to max_count completed requests into completed[], returning how many there
+// were. If wait is set and nothing has completed yet, blocks until something does, unless
+// there's nothing outstanding to wait for.
+int dsk2woz2_queue_reap(dsk2woz2_queue * queue, dsk2woz2_request * completed[], int max_count, int wait)
+{
+    int count = 0;
+    pthread_mutex_lock(&queue->lock);
+    while (wait && !queue->completed_head && (queue->pending_count > 0 || queue->converting_count > 0)) {
+        pthread_cond_wait(&queue->work_completed, &queue->lock);
+    }
+    while (count < max_count && queue->completed_head) {
+        completed[count++] = queue->completed_head;
+        queue->completed_head = queue->completed_head->next;
+    }
+    queue->completed_count -= count;
+    trace_counter(trace_name_queue_completed, queue->completed_count);
+    if (!queue->completed_head) {
+        queue->completed_tail = NULL;
+        if (queue->completion_signaled) {
+            clear_completion_fd(queue);
+            queue->completion_signaled = 0;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+// Stops the workers and frees the queue. Requests still pending are abandoned.
+void dsk2woz2_queue_destroy(dsk2woz2_queue * queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->shutting_down = 1;
+    pthread_cond_broadcast(&queue->work_available);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (int i = 0; i < queue->worker_count; i++) {
+        pthread_join(queue->workers[i], NULL);
+    }
+    pthread_cond_destroy(&queue->work_completed);
+    pthread_cond_destroy(&queue->work_available);
+    pthread_mutex_destroy(&queue->lock);
+    close(queue->completion_fd[0]);
+    if (queue->completion_fd[1] != queue->completion_fd[0]) {
+        close(queue->completion_fd[1]);
+    }
+    free(queue);
+}
+
+static
+void * queue_worker(void * context)
+{
+    dsk2woz2_queue * queue = context;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (!queue->pending_head && !queue->shutting_down) {
+            pthread_cond_wait(&queue->work_available, &queue->lock);
+        }
+        if (queue->shutting_down) {
+            pthread_mutex_unlock(&queue->lock);
+            return NULL;
+        }
+        dsk2woz2_request * request = queue->pending_head;
+        queue->pending_head = request->next;
+        if (!queue->pending_head) {
+            queue->pending_tail = NULL;
+        }
+        queue->pending_count--;
+        queue->converting_count++;
+        trace_counter(trace_name_queue_pending, queue->pending_count);
+        pthread_mutex_unlock(&queue->lock);
+
+        trace_set_image(request->name);
+        request->woz_size = dsk2woz2_convert_image(request->woz, request->woz_capacity,
+                                                   request->image, &request->probe,
+                                                   &request->options);
+
+        // Only the first completion of a batch touches the descriptor; the reaper
+        // clears it once it has drained the queue.
+        request->next = NULL;
+        pthread_mutex_lock(&queue->lock);
+        if (queue->completed_tail) {
+            queue->completed_tail->next = request;
+        } else {
+            queue->completed_head = request;
+        }
+        queue->completed_tail = request;
+        queue->converting_count--;
+        queue->completed_count++;
+        trace_counter(trace_name_queue_completed, queue->completed_count);
+        if (!queue->completion_signaled) {
+            signal_completion_fd(queue);
+            queue->completion_signaled = 1;
+        }
+        pthread_cond_signal(&queue->work_completed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+static
+void signal_completion_fd(dsk2woz2_queue * queue)
+{
+#ifdef __linux__
+    const uint64_t one = 1;
+    while (write(queue->completion_fd[1], &one, sizeof(one)) < 0 && errno == EINTR) { }
+#else
+    const uint8_t one = 1;
+    while (write(queue->completion_fd[1], &one, sizeof(one)) < 0 && errno == EINTR) { }
+#endif
+}
+
+static
+void clear_completion_fd(dsk2woz2_queue * queue)
+{
+#ifdef __linux__
+    uint64_t count;
+#else
+    uint8_t count;
+#endif
+    while (read(queue->completion_fd[0], &count, sizeof(count)) < 0 && errno == EINTR) { }
+}
+
+//
+// Tracing routines
+//
+
+#define TRACE_CHUNK_EVENTS  4096
+
+typedef struct _trace_event {
+    uint64_t start;             // Nanoseconds since tracing started
+    uint64_t duration;          // Nanoseconds (spans only)
+    uint32_t image;             // Index into trace_images, or UINT32_MAX for none
+    int32_t arg;                // Track number for spans (-1 if none), value for counters
+    uint16_t gets;              // Objects fetched and stored, for transfer spans
+    uint16_t puts;
+    uint8_t name;               // trace_name
+} trace_event;
+
+typedef struct _trace_chunk {
+    struct _trace_chunk * next;
+    int count;
+    trace_event events[TRACE_CHUNK_EVENTS];
+} trace_chunk;
+
+// One per thread, so that recording never takes a lock. They're kept on a list to be
+// written out at the end, even for threads that have gone away by then.
+typedef struct _trace_buffer {
+    struct _trace_buffer * next;
+    int thread_index;
+    trace_chunk * first;
+    trace_chunk * last;
+    const char * image_label;   // The interned copy of the last label set by this thread
+    uint32_t image;
+} trace_buffer;
+
+static const char * const trace_names[] = {
+    "read", "convert", "assemble", "encode", "crc", "write", "verify", "transfer", "queue pending",
+    "queue completed"
+};
+
+static volatile int trace_enabled;
+static struct timespec trace_epoch;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer * trace_buffers;
+static int trace_thread_count;
+static char ** trace_images;
+static uint32_t trace_image_count;
+static uint32_t trace_image_capacity;
+static uint32_t * trace_image_table;    // Open addressed by label hash; image index + 1, or 0
+static uint32_t trace_image_table_size;
+static _Thread_local trace_buffer * trace_thread_buffer;
+
+void dsk2woz2_trace_start(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+    trace_enabled = 1;
+}
+
+static
+uint64_t trace_begin(void)
+{
+    if (!trace_enabled) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)(now.tv_sec - trace_epoch.tv_sec) * 1000000000) + now.tv_nsec - trace_epoch.tv_nsec;
+}
+
+static
+trace_buffer * trace_buffer_for_thread(void)
+{
+    if (!trace_thread_buffer) {
+        trace_buffer * buffer = calloc(1, sizeof(trace_buffer));
+        if (!buffer) { return NULL; }
+        buffer->image = UINT32_MAX;
+        pthread_mutex_lock(&trace_lock);
+        buffer->thread_index = ++trace_thread_count;
+        buffer->next = trace_buffers;
+        trace_buffers = buffer;
+        pthread_mutex_unlock(&trace_lock);
+        trace_thread_buffer = buffer;
+    }
+    return trace_thread_buffer;
+}
+
+static
+trace_event * trace_record(trace_name name, uint64_t start, uint64_t duration, int arg)
+{
+    trace_buffer * buffer = trace_buffer_for_thread();
+    if (!buffer) { return NULL; }
+    if (!buffer->last || buffer->last->count == TRACE_CHUNK_EVENTS) {
+        trace_chunk * chunk = malloc(sizeof(trace_chunk));
+        if (!chunk) { return NULL; }
+        chunk->next = NULL;
+        chunk->count = 0;
+        if (buffer->last) {
+            buffer->last->next = chunk;
+        } else {
+            buffer->first = chunk;
+        }
+        buffer->last = chunk;
+    }
+    trace_event * event = &buffer->last->events[buffer->last->count++];
+    event->start = start;
+    event->duration = duration;
+    event->image = buffer->image;
+    event->arg = arg;
+    event->gets = 0;
+    event->puts = 0;
+    event->name = (uint8_t)name;
+    return event;
+}
+
+// Records a span from start (as returned by trace_begin) until now.
+static
+void trace_end(trace_name name, uint64_t start, int arg)
+{
+    if (trace_enabled) {
+        trace_record(name, start, trace_begin() - start, arg);
+    }
+}
 
-#define TRACKS_PER_DISK     35
-#define SECTORS_PER_TRACK   16
-#define BYTES_PER_SECTOR    256
-#define BYTES_PER_TRACK     (SECTORS_PER_TRACK * BYTES_PER_SECTOR)
-#define DSK_IMAGE_SIZE      (TRACKS_PER_DISK * BYTES_PER_TRACK)
+#ifndef DSK2WOZ2_NO_MAIN   // Only the utility talks to an object store
+// Records a round of object store requests from start until now, with how many objects
+// went each way.
+static
+void trace_end_transfer(uint64_t start, int gets, int puts)
+{
+    if (trace_enabled) {
+        trace_event * event = trace_record(trace_name_transfer, start, trace_begin() - start, -1);
+        if (event) {
+            event->gets = (gets < UINT16_MAX) ? (uint16_t)gets : UINT16_MAX;
+            event->puts = (puts < UINT16_MAX) ? (uint16_t)puts : UINT16_MAX;
+        }
+    }
+}
+#endif
 
-#define BITS_BLOCKS_PER_TRACK       13
-#define BITS_BLOCK_SIZE             512
-#define BITS_TRACK_SIZE             (BITS_BLOCKS_PER_TRACK * BITS_BLOCK_SIZE)
-#define BITS_SECTOR_CONTENTS_SIZE   343
-#define WOZ_HEADER_SIZE             12
+static
+void trace_counter(trace_name name, int value)
+{
+    if (trace_enabled) {
+        trace_record(name, trace_begin(), 0, value);
+    }
+}
 
-#define DOS_VOLUME_NUMBER           254
-#define TRACK_LEADER_SYNC_COUNT     64
+static
+uint32_t trace_label_hash(const char * label)
+{
+    uint32_t hash = 2166136261u;    // FNV-1a
+    for (const unsigned char * c = (const unsigned char *)label; *c; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
 
-typedef enum _dsk_sector_format {
-    dsk_sector_format_dos_3_3 = 0,
-    dsk_sector_format_prodos = 1
-} dsk_sector_format;
+// Returns the image index for the label, adding it if it's new. Call with trace_lock held.
+// Returns UINT32_MAX if allocation fails.
+static
+uint32_t trace_intern_image(const char * label)
+{
+    const uint32_t hash = trace_label_hash(label);
+    uint32_t slot = hash & (trace_image_table_size - 1);
+    for (; trace_image_table_size && trace_image_table[slot]; slot = (slot + 1) & (trace_image_table_size - 1)) {
+        if (strcmp(trace_images[trace_image_table[slot] - 1], label) == 0) {
+            return trace_image_table[slot] - 1;
+        }
+    }
 
-typedef struct _woz_chunk {
-    uint32_t name;
-    size_t data_length;
-    uint8_t data[0];
-} woz_chunk;
+    // Keep the table no more than half full.
+    if ((trace_image_count + 1) * 2 > trace_image_table_size) {
+        const uint32_t size = trace_image_table_size ? trace_image_table_size * 2 : 2048;
+        uint32_t * table = calloc(size, sizeof(uint32_t));
+        if (!table) { return UINT32_MAX; }
+        for (uint32_t i = 0; i < trace_image_count; i++) {
+            uint32_t s = trace_label_hash(trace_images[i]) & (size - 1);
+            while (table[s]) {
+                s = (s + 1) & (size - 1);
+            }
+            table[s] = i + 1;
+        }
+        free(trace_image_table);
+        trace_image_table = table;
+        trace_image_table_size = size;
+        slot = hash & (size - 1);
+        while (table[slot]) {
+            slot = (slot + 1) & (size - 1);
+        }
+    }
+    if (trace_image_count == trace_image_capacity) {
+        uint32_t capacity = trace_image_capacity ? trace_image_capacity * 2 : 1024;
+        char ** grown = realloc(trace_images, capacity * sizeof(char *));
+        if (!grown) { return UINT32_MAX; }
+        trace_images = grown;
+        trace_image_capacity = capacity;
+    }
+    char * copy = malloc(strlen(label) + 1);
+    if (!copy) { return UINT32_MAX; }
+    strcpy(copy, label);
+    trace_images[trace_image_count] = copy;
+    trace_image_table[slot] = trace_image_count + 1;
+    return trace_image_count++;
+}
 
-//
-// Forward declarations for utility routines
-//
+// Sets the image this thread's spans belong to. Labels are matched by content and each
+// distinct one is copied once, since the caller's string may not outlive the trace (or may
+// be freed and its address reused for another name).
+static
+void trace_set_image(const char * label)
+{
+    if (!trace_enabled) { return; }
+    trace_buffer * buffer = trace_buffer_for_thread();
+    if (!buffer) { return; }
+    if (!label) {
+        buffer->image_label = NULL;
+        buffer->image = UINT32_MAX;
+        return;
+    }
+    if (buffer->image_label && strcmp(buffer->image_label, label) == 0) { return; }
 
-static woz_chunk * create_info_chunk(void);
-static woz_chunk * create_tmap_chunk(void);
-static woz_chunk * create_trks_chunk(uint8_t * track_data, uint32_t valid_bits_per_track);
-static woz_chunk * create_writ_chunk(uint8_t * track_data, uint32_t valid_bits_per_track);
-static size_t total_chunk_size(woz_chunk * chunk);
-static size_t write_chunk(uint8_t * dest, woz_chunk * chunk);
-static void free_chunk(woz_chunk * chunk);
+    pthread_mutex_lock(&trace_lock);
+    buffer->image = trace_intern_image(label);
+    buffer->image_label = (buffer->image != UINT32_MAX) ? trace_images[buffer->image] : NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
 
-static void write_uint8(uint8_t * dest, uint8_t value);
-static void write_uint16(uint8_t * dest, uint16_t value);
-static void write_uint32(uint8_t * dest, uint32_t value);
-static void write_utf8(uint8_t * dest, const char * utf8string, int n);
+static
+void write_json_string(FILE * file, const char * string)
+{
+    fputc('"', file);
+    for (const unsigned char * c = (const unsigned char *)string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
 
-static size_t encode_bits_for_track(uint8_t * dest, uint8_t * src, int track_number, dsk_sector_format sector_format);
+// Stops tracing and writes out everything recorded. Call this once the conversions are
+// finished. Returns 0 on success.
+int dsk2woz2_trace_write(const char * path)
+{
+    trace_enabled = 0;
+    FILE * const file = fopen(path, "w");
+    if (!file) {
+        return -1;
+    }
 
-static uint32_t crc32(uint32_t crc, const void * buf, size_t size);
+    pthread_mutex_lock(&trace_lock);
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    int first = 1;
+    for (trace_buffer * buffer = trace_buffers; buffer; buffer = buffer->next) {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"thread %d\"}}", first ? "" : ",\n",
+                buffer->thread_index, buffer->thread_index);
+        first = 0;
+        for (trace_chunk * chunk = buffer->first; chunk; chunk = chunk->next) {
+            for (int i = 0; i < chunk->count; i++) {
+                const trace_event * event = &chunk->events[i];
+                if (event->name >= trace_name_queue_pending) {
+                    fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                            "\"args\":{\"depth\":%d}}", trace_names[event->name], buffer->thread_index,
+                            event->start / 1000.0, (int)event->arg);
+                    continue;
+                }
+                fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"args\":{", trace_names[event->name], buffer->thread_index,
+                        event->start / 1000.0, event->duration / 1000.0);
+                const char * separator = "";
+                if (event->image < trace_image_count) {
+                    fprintf(file, "\"image\":");
+                    write_json_string(file, trace_images[event->image]);
+                    separator = ",";
+                }
+                if (event->arg >= 0) {
+                    fprintf(file, "%s\"track\":%d", separator, (int)event->arg);
+                    separator = ",";
+                }
+                if (event->name == trace_name_transfer) {
+                    fprintf(file, "%s\"gets\":%d,\"puts\":%d", separator, event->gets, event->puts);
+                }
+                fprintf(file, "}}");
+            }
+        }
+    }
+    fprintf(file, "\n]}\n");
+    pthread_mutex_unlock(&trace_lock);
+    return (fclose(file) == 0) ? 0 : -1;
+}
 
 //
-// Utility entry point
+// Compact resident disk routines
 //
 
-int main(int argc, const char * argv[])
+static dsk2woz2_skeleton * shared_skeleton;
+static pthread_once_t shared_skeleton_once = PTHREAD_ONCE_INIT;
+
+static
+void build_shared_skeleton(void)
 {
-    if (argc != 3) {
-        printf("USAGE: dsk2woz2 input.dsk output.woz\n");
-        return -1;
+    static const uint8_t zero_track[BYTES_PER_TRACK];
+    dsk2woz2_skeleton * skeleton = malloc(sizeof(dsk2woz2_skeleton));
+    if (!skeleton) { return; }
+    for (int t = 0; t < TRACKS_PER_DISK; t++) {
+        skeleton->valid_bits_per_track = (uint32_t)encode_bits_for_track(skeleton->bits[t], zero_track, t,
+                                                                         dsk2woz2_sector_format_dos_3_3,
+                                                                         skeleton->data_bit_offsets);
     }
+    shared_skeleton = skeleton;
+}
 
-    // Read the input DSK file.
-    FILE * const dsk_file = fopen(argv[1], "rb");
-    if (!dsk_file) {
-        printf("ERROR: could not open %s for reading\n", argv[1]);
-        return -2;
+// The skeleton is built the first time it's asked for, and then lives for the life of the
+// process. Returns NULL if it couldn't be allocated.
+const dsk2woz2_skeleton * dsk2woz2_shared_skeleton(void)
+{
+    pthread_once(&shared_skeleton_once, build_shared_skeleton);
+    return shared_skeleton;
+}
+
+// Opaque to the header, since C++ has no flexible array members.
+struct _dsk2woz2_compact_disk {
+    uint16_t sector_index[TRACKS_PER_DISK][SECTORS_PER_TRACK];  // By physical sector; 0 = all zeroes
+    uint16_t sector_count;
+    uint8_t sectors[][BYTES_PER_SECTOR];                        // sector_index - 1 indexes these
+};
+
+static
+int sector_is_zero(const uint8_t * sector)
+{
+    for (int i = 0; i < BYTES_PER_SECTOR; i++) {
+        if (sector[i]) {
+            return 0;
+        }
     }
-    
-    uint8_t dsk[DSK_IMAGE_SIZE];
-    const size_t bytes_read = fread(dsk, 1, DSK_IMAGE_SIZE, dsk_file);
-    fclose(dsk_file);
-    
-    if (bytes_read != DSK_IMAGE_SIZE) {
-        printf("ERROR: file %s does not appear to be a 16-sector 5.25\" disk image", argv[1]);
-        return -2;
+    return 1;
+}
+
+// Returns NULL if the DSK image is the wrong size or allocation fails. Free the disk with
+// dsk2woz2_compact_free.
+dsk2woz2_compact_disk * dsk2woz2_compact_create(const uint8_t * dsk, size_t dsk_size, dsk2woz2_sector_format sector_format)
+{
+    if (dsk_size != DSK_IMAGE_SIZE || !dsk2woz2_shared_skeleton()) {
+        return NULL;
     }
-    
-    // Assume the standard DOS 3.3 sector format unless the input filename ends in
-    // .po, which indicates ProDOS sectoring. (The sector format of the image is not
-    // necessarily the same as the formatting of the disk.)
-    dsk_sector_format sector_format = dsk_sector_format_dos_3_3;
-    if (strlen(argv[1]) > 3 &&
-        strncmp(&(argv[1][strlen(argv[1])-3]), ".po", 3) == 0) {
-        sector_format = dsk_sector_format_prodos;
+
+    // Count first so that the disk is a single allocation of exactly the right size.
+    int sector_count = 0;
+    for (int i = 0; i < TRACKS_PER_DISK * SECTORS_PER_TRACK; i++) {
+        sector_count += !sector_is_zero(&dsk[i * BYTES_PER_SECTOR]);
     }
-    
-    // Build the encoded track data. We do this up front because we'll need to access it within
-    // both the TRKS and the WRIT chunk creation.
-    uint8_t track_data[TRACKS_PER_DISK * BITS_TRACK_SIZE];
-    size_t valid_bits_per_track = 0;  // Re-set each loop, we just need to know the fixed value.
+    dsk2woz2_compact_disk * disk = malloc(sizeof(dsk2woz2_compact_disk) + (sector_count * BYTES_PER_SECTOR));
+    if (!disk) { return NULL; }
+
+    disk->sector_count = 0;
     for (int t = 0; t < TRACKS_PER_DISK; t++) {
-        valid_bits_per_track = encode_bits_for_track(&track_data[t * BITS_TRACK_SIZE],
-                                                     &dsk[t * BYTES_PER_TRACK],
-                                                     t, sector_format);
+        for (int s = 0; s < SECTORS_PER_TRACK; s++) {
+            const uint8_t * sector = &dsk[(t * BYTES_PER_TRACK) +
+                                          (logical_sector_for_physical(s, sector_format) * BYTES_PER_SECTOR)];
+            if (sector_is_zero(sector)) {
+                disk->sector_index[t][s] = 0;
+            } else {
+                memcpy(disk->sectors[disk->sector_count++], sector, BYTES_PER_SECTOR);
+                disk->sector_index[t][s] = disk->sector_count;
+            }
+        }
     }
-    
-    // Build the chunks.
-    woz_chunk * info_chunk = create_info_chunk();
-    woz_chunk * tmap_chunk = create_tmap_chunk();
-    woz_chunk * trks_chunk = create_trks_chunk(track_data, (uint32_t)valid_bits_per_track);
-    woz_chunk * writ_chunk = create_writ_chunk(track_data, (uint32_t)valid_bits_per_track);
+    return disk;
+}
 
-    if (!info_chunk || !tmap_chunk || !trks_chunk || !writ_chunk) {
-        printf("ERROR: memory allocation failed");
-        return -2;
+void dsk2woz2_compact_free(dsk2woz2_compact_disk * disk)
+{
+    free(disk);
+}
+
+// Materializes bit_count bits of the track, starting at bit_index, into dest (most significant
+// bit first, as in a WOZ BITS block). The window wraps around the end of the track the way the
+// disk does, so it may be any length. Returns the number of bits written.
+size_t dsk2woz2_compact_read_bits(const dsk2woz2_compact_disk * disk, int track,
+                                  uint32_t bit_index, uint32_t bit_count, uint8_t * dest)
+{
+    const dsk2woz2_skeleton * skeleton = dsk2woz2_shared_skeleton();
+    if (!skeleton || track < 0 || track >= TRACKS_PER_DISK) {
+        return 0;
     }
-    
-    // Create the final output buffer.
-    size_t woz_image_size = WOZ_HEADER_SIZE +
-                            total_chunk_size(info_chunk) +
-                            total_chunk_size(tmap_chunk) +
-                            total_chunk_size(trks_chunk) +
-                            total_chunk_size(writ_chunk);
-    uint8_t * woz = malloc(woz_image_size);
-    if (!woz) {
-        printf("ERROR: memory allocation failed");
-        return -2;
+    const uint32_t track_bits = skeleton->valid_bits_per_track;
+    bit_index %= track_bits;
+
+    size_t dest_index = 0;
+    while (dest_index < bit_count) {
+        // Take as much as we can before the track wraps around.
+        uint32_t start = bit_index;
+        uint32_t count = track_bits - start;
+        if (count > bit_count - dest_index) {
+            count = (uint32_t)(bit_count - dest_index);
+        }
+        const uint32_t end = start + count;
+
+        // Start from the skeleton, then lay in the data fields of any non-zero sectors the
+        // window overlaps. Nibbles that straddle the window edges land outside it harmlessly.
+        uint8_t scratch[BITS_TRACK_SIZE + 1];
+        const uint32_t first_byte = start / 8;
+        const uint32_t last_byte = (end - 1) / 8;
+        memcpy(&scratch[first_byte], &skeleton->bits[track][first_byte], last_byte - first_byte + 1);
+        for (int s = 0; s < SECTORS_PER_TRACK; s++) {
+            const uint32_t data_start = skeleton->data_bit_offsets[s];
+            const uint32_t data_end = data_start + (BITS_SECTOR_CONTENTS_SIZE * 8);
+            if (disk->sector_index[track][s] == 0 || data_end <= start || data_start >= end) {
+                continue;
+            }
+            uint8_t encoded_contents[BITS_SECTOR_CONTENTS_SIZE];
+            encode_6_and_2(encoded_contents, disk->sectors[disk->sector_index[track][s] - 1]);
+            int first_nibble = (start > data_start) ? (int)((start - data_start) / 8) : 0;
+            int last_nibble = (end < data_end) ? (int)((end - 1 - data_start) / 8) : BITS_SECTOR_CONTENTS_SIZE - 1;
+            for (int i = first_nibble; i <= last_nibble; i++) {
+                bits_put_byte(scratch, data_start + (i * 8), encoded_contents[i]);
+            }
+        }
+
+        // Shift the window out to the destination.
+        for (uint32_t b = start; b < end; b++, dest_index++) {
+            const uint8_t mask = 0x80 >> (dest_index & 7);
+            if (scratch[b >> 3] & (0x80 >> (b & 7))) {
+                dest[dest_index >> 3] |= mask;
+            } else {
+                dest[dest_index >> 3] &= ~mask;
+            }
+        }
+        bit_index = 0;
     }
-        
-    // Emit the header. Leave the CRC slot empty; will write that last.
-    woz[0] = 'W'; woz[1] = 'O'; woz[2] = 'Z'; woz[3] = '2';   // 'WOZ2' magic number
-    woz[4] = 0xFF;                                 // Marker to ensure high bits present
-    woz[5] = '\n'; woz[6] = '\r'; woz[7] = '\n';   // LF CR LF to ensure no text transforms
-    
-    // Copy the chunk data in order.
-    size_t output_index = WOZ_HEADER_SIZE;
-    output_index += write_chunk(&woz[output_index], info_chunk);
-    output_index += write_chunk(&woz[output_index], tmap_chunk);
-    output_index += write_chunk(&woz[output_index], trks_chunk);
-    output_index += write_chunk(&woz[output_index], writ_chunk);
+    return dest_index;
+}
 
-    // Unnecessary boy scoutery...
-    free_chunk(info_chunk);
-    free_chunk(tmap_chunk);
-    free_chunk(trks_chunk);
-    free_chunk(writ_chunk);
+//
+// Mastering routines
+//
 
-    // Compute the overall CRC of everthing after the header, and write it in.
-    uint32_t crc = crc32(0, &woz[WOZ_HEADER_SIZE], woz_image_size - WOZ_HEADER_SIZE);
-    write_uint32(&woz[8], crc);
-    
-    // Write the output file
-    FILE * const woz_file = fopen(argv[2], "wb");
-    if (!woz_file) {
-        printf("ERROR: Could not open %s for writing\n", argv[2]);
-        return -5;
+struct _dsk2woz2_master {
+    uint8_t dsk[DSK_IMAGE_SIZE];                    // The base image
+    uint8_t woz[WOZ_IMAGE_SIZE];                    // The current variant, encoded
+    size_t woz_size;
+    dsk2woz2_sector_format sector_format;
+    uint8_t * track_bits[TRACKS_PER_DISK];          // Into woz
+    uint8_t * writ_crcs[TRACKS_PER_DISK];           // Into woz's WRIT chunk
+    uint32_t bytes_for_crc;                         // How much of each track the WRIT CRCs cover
+    uint8_t dirty[TRACKS_PER_DISK * SECTORS_PER_TRACK]; // Sectors differing from the base, by file position
+};
+
+// Returns NULL if the DSK image is the wrong size or allocation fails. Free the master with
+// dsk2woz2_master_free.
+dsk2woz2_master * dsk2woz2_master_create(const uint8_t * dsk, size_t dsk_size, const dsk2woz2_options * options)
+{
+    dsk2woz2_master * master = calloc(1, sizeof(dsk2woz2_master));
+    if (!master || !dsk2woz2_shared_skeleton()) {
+        free(master);
+        return NULL;
+    }
+    master->woz_size = dsk2woz2_convert(master->woz, WOZ_IMAGE_SIZE, dsk, dsk_size, options);
+    if (master->woz_size == 0) {
+        free(master);
+        return NULL;
     }
+    memcpy(master->dsk, dsk, DSK_IMAGE_SIZE);
+    master->sector_format = options->sector_format;
 
-    size_t bytes_written = fwrite(woz, 1, woz_image_size, woz_file);
-    fclose(woz_file);
-    free(woz);
-    
-    if(bytes_written != woz_image_size) {
-        printf("ERROR: Could not write full WOZ image\n");
-        return -6;
+    // Find each track's bits through the TRK table, since the track order is up to the options.
+    uint32_t trks_length, writ_length;
+    const uint8_t * trks = find_chunk(master->woz, master->woz_size, "TRKS", &trks_length);
+    const uint8_t * writ = find_chunk(master->woz, master->woz_size, "WRIT", &writ_length);
+    for (int t = 0; t < TRACKS_PER_DISK; t++) {
+        master->track_bits[t] = &master->woz[read_uint16(&trks[t * 8]) * BITS_BLOCK_SIZE];
+        master->writ_crcs[t] = &master->woz[(writ - master->woz) + (t * 20) + 4];
     }
+    master->bytes_for_crc = (read_uint32(&trks[4]) + 7) / 8;
+    return master;
+}
 
-    return 0;
+void dsk2woz2_master_free(dsk2woz2_master * master)
+{
+    free(master);
+}
+
+// Produces the base image with the patches applied, and returns it. The image stays valid
+// until the next call. Sectors are re-encoded only where this variant or the last one differs
+// from the base, and the CRCs are patched from the bytes that changed rather than recomputed.
+// Returns NULL if a patch falls outside the disk.
+const uint8_t * dsk2woz2_master_variant(dsk2woz2_master * master, const dsk2woz2_patch patches[], int patch_count,
+                                        size_t * woz_size)
+{
+    const dsk2woz2_skeleton * skeleton = dsk2woz2_shared_skeleton();
+    for (int p = 0; p < patch_count; p++) {
+        if (patches[p].offset > DSK_IMAGE_SIZE || patches[p].length > DSK_IMAGE_SIZE - patches[p].offset) {
+            return NULL;
+        }
+    }
+    uint8_t touched[TRACKS_PER_DISK * SECTORS_PER_TRACK];
+    memcpy(touched, master->dirty, sizeof(touched));
+    memset(master->dirty, 0, sizeof(master->dirty));
+    for (int p = 0; p < patch_count; p++) {
+        for (size_t i = patches[p].offset / BYTES_PER_SECTOR;
+             i * BYTES_PER_SECTOR < patches[p].offset + patches[p].length; i++) {
+            touched[i] = master->dirty[i] = 1;
+        }
+    }
+
+    uint32_t file_crc = read_uint32(&master->woz[8]);
+    for (int t = 0; t < TRACKS_PER_DISK; t++) {
+        uint32_t track_crc = read_uint32(master->writ_crcs[t]);
+        int track_changed = 0;
+        for (int s = 0; s < SECTORS_PER_TRACK; s++) {
+            const int file_sector = logical_sector_for_physical(s, master->sector_format);
+            const size_t sector_offset = (t * BYTES_PER_TRACK) + (file_sector * BYTES_PER_SECTOR);
+            if (!touched[sector_offset / BYTES_PER_SECTOR]) {
+                continue;
+            }
+
+            // Lay this variant's patches over the base sector and encode it.
+            uint8_t contents[BYTES_PER_SECTOR];
+            memcpy(contents, &master->dsk[sector_offset], BYTES_PER_SECTOR);
+            for (int p = 0; p < patch_count; p++) {
+                const size_t start = (patches[p].offset > sector_offset) ? patches[p].offset : sector_offset;
+                const size_t patch_end = patches[p].offset + patches[p].length;
+                const size_t end = (patch_end < sector_offset + BYTES_PER_SECTOR) ? patch_end : sector_offset + BYTES_PER_SECTOR;
+                if (start < end) {
+                    memcpy(&contents[start - sector_offset], &patches[p].data[start - patches[p].offset], end - start);
+                }
+            }
+            uint8_t encoded_contents[BITS_SECTOR_CONTENTS_SIZE];
+            encode_6_and_2(encoded_contents, contents);
+
+            // Put the nibbles in place, keeping the bytes they overwrite for the CRCs.
+            uint8_t * bits = master->track_bits[t];
+            const uint32_t data_start = skeleton->data_bit_offsets[s];
+            const uint32_t first_byte = data_start / 8;
+            const uint32_t end_byte = ((data_start + (BITS_SECTOR_CONTENTS_SIZE * 8) - 1) / 8) + 1;
+            uint8_t old_bytes[BITS_SECTOR_CONTENTS_SIZE + 1];
+            memcpy(old_bytes, &bits[first_byte], end_byte - first_byte);
+            for (int i = 0; i < BITS_SECTOR_CONTENTS_SIZE; i++) {
+                bits_put_byte(bits, data_start + (i * 8), encoded_contents[i]);
+            }
+            track_crc = crc32_patch(track_crc, old_bytes, &bits[first_byte], end_byte - first_byte,
+                                    master->bytes_for_crc - end_byte);
+            file_crc = crc32_patch(file_crc, old_bytes, &bits[first_byte], end_byte - first_byte,
+                                   master->woz_size - (size_t)(&bits[end_byte] - master->woz));
+            track_changed = 1;
+        }
+
+        if (track_changed) {
+            uint8_t old_crc[4];
+            memcpy(old_crc, master->writ_crcs[t], 4);
+            write_uint32(master->writ_crcs[t], track_crc);
+            file_crc = crc32_patch(file_crc, old_crc, master->writ_crcs[t], 4,
+                                   master->woz_size - (size_t)(master->writ_crcs[t] + 4 - master->woz));
+        }
+    }
+    write_uint32(&master->woz[8], file_crc);
+    *woz_size = master->woz_size;
+    return master->woz;
 }
 
 //
-// Chunk creation and writing utility routines
+// HFE conversion routines
 //
 
-woz_chunk * create_chunk(const char * name, size_t data_length)
+// Each Apple bit becomes two HFE cells, a flux transition (or not) then a blank, and HFE
+// stores cells least significant bit first. This spreads the four bits of a nibble, first
+// bit in time highest, across the even cells of a byte.
+static const uint8_t hfe_cells_for_nibble[] = {
+    0x00, 0x40, 0x10, 0x50, 0x04, 0x44, 0x14, 0x54,
+    0x01, 0x41, 0x11, 0x51, 0x05, 0x45, 0x15, 0x55
+};
+
+// Converts the WOZ image's whole tracks into an HFE (v1) image. If hfe is NULL, just returns
+// the size it would need. Returns the HFE size, or 0 if the WOZ image isn't a WOZ2 image or
+// hfe_capacity is too small.
+size_t dsk2woz2_woz_to_hfe(uint8_t * hfe, size_t hfe_capacity, const uint8_t * woz, size_t woz_size)
 {
-    woz_chunk * chunk = calloc(sizeof(woz_chunk) + data_length, 1);
-    if (chunk) {
-        memcpy(&chunk->name, name, 4);
-        chunk->data_length = data_length;
+    uint32_t tmap_length, trks_length;
+    const uint8_t * tmap = find_chunk(woz, woz_size, "TMAP", &tmap_length);
+    const uint8_t * trks = find_chunk(woz, woz_size, "TRKS", &trks_length);
+    if (!tmap || !trks || tmap_length < 160 || trks_length < 160 * 8 || memcmp(woz, "WOZ2", 4) != 0) {
+        return 0;
+    }
+
+    // Find each whole track's bits; HFE has no quarter tracks.
+    int track_count = 0;
+    const uint8_t * track_bits[40];
+    uint32_t track_bit_counts[40];
+    for (int t = 0; t < 40; t++) {
+        const uint8_t trk_index = tmap[t * 4];
+        track_bits[t] = NULL;
+        track_bit_counts[t] = HFE_EMPTY_TRACK_BITS;
+        if (trk_index == 0xFF || trk_index >= 160) {
+            continue;
+        }
+        const uint8_t * trk = &trks[trk_index * 8];
+        const size_t offset = read_uint16(&trk[0]) * (size_t)BITS_BLOCK_SIZE;
+        const uint32_t bit_count = read_uint32(&trk[4]);
+        if (bit_count == 0 || offset + ((bit_count + 7) / 8) > woz_size ||
+            bit_count > read_uint16(&trk[2]) * (uint32_t)BITS_BLOCK_SIZE * 8) {
+            return 0;
+        }
+        track_bits[t] = &woz[offset];
+        track_bit_counts[t] = bit_count;
+        track_count = t + 1;
+    }
+
+    // Lay out the file: header block, track list block, then each track in whole blocks.
+    size_t hfe_size = 2 * HFE_BLOCK_SIZE;
+    for (int t = 0; t < track_count; t++) {
+        const size_t side_length = ((track_bit_counts[t] * 2) + 7) / 8;
+        hfe_size += ((side_length + 255) / 256) * HFE_BLOCK_SIZE;
+    }
+    if (!hfe) {
+        return hfe_size;
     }
-    return chunk;
+    if (hfe_capacity < hfe_size) {
+        return 0;
+    }
+
+    // Header. Anything not set is left 0xFF, as the format asks.
+    memset(hfe, 0xFF, 2 * HFE_BLOCK_SIZE);
+    memcpy(hfe, "HXCPICFE", 8);
+    write_uint8(&hfe[8], 0);                // Format revision
+    write_uint8(&hfe[9], track_count);      // Number of tracks
+    write_uint8(&hfe[10], 1);               // Number of sides
+    write_uint8(&hfe[11], 0xFF);            // Track encoding (unknown, i.e. not MFM/FM)
+    write_uint16(&hfe[12], HFE_BIT_RATE);   // Bit rate in kbit/s
+    write_uint16(&hfe[14], HFE_RPM);        // RPM
+    write_uint8(&hfe[16], 0x07);            // Interface mode (generic Shugart)
+    write_uint8(&hfe[17], 0);               // Unused
+    write_uint16(&hfe[18], 1);              // Track list offset, in blocks
+    write_uint8(&hfe[20], 0xFF);            // Write allowed
+    write_uint8(&hfe[21], 0xFF);            // Single step
+
+    size_t block = 2;
+    for (int t = 0; t < track_count; t++) {
+        const uint32_t bit_count = track_bit_counts[t];
+        const size_t side_length = ((bit_count * 2) + 7) / 8;
+        const size_t block_count = (side_length + 255) / 256;
+        uint8_t * const track = &hfe[block * HFE_BLOCK_SIZE];
+        write_uint16(&hfe[HFE_BLOCK_SIZE + (t * 4)], (uint16_t)block);
+        write_uint16(&hfe[HFE_BLOCK_SIZE + (t * 4) + 2], (uint16_t)(side_length * 2));
+        memset(track, 0, block_count * HFE_BLOCK_SIZE);
+
+        // Each block holds 256 bytes of side 0 and then 256 bytes of side 1; this being a
+        // single sided disk, side 1 stays blank. Every WOZ byte makes two HFE bytes.
+        if (track_bits[t]) {
+            for (uint32_t i = 0; i < (bit_count + 7) / 8; i++) {
+                uint8_t bits = track_bits[t][i];
+                if ((i + 1) * 8 > bit_count) {
+                    bits &= (uint8_t)(0xFF << (((i + 1) * 8) - bit_count));
+                }
+                const size_t cell_byte = i * 2;
+                track[((cell_byte / 256) * HFE_BLOCK_SIZE) + (cell_byte % 256)] = hfe_cells_for_nibble[bits >> 4];
+                if (cell_byte + 1 < side_length) {
+                    track[(((cell_byte + 1) / 256) * HFE_BLOCK_SIZE) + ((cell_byte + 1) % 256)] =
+                        hfe_cells_for_nibble[bits & 0x0F];
+                }
+            }
+        }
+        block += block_count;
+    }
+    return hfe_size;
+}
+
+//
+// Chunk writing utility routines
+//
+
+// Writes the chunk header and clears the chunk data, returning a pointer to the data.
+// !! DO NOT mess up knowing how much runway remains in dest.
+static
+uint8_t * begin_chunk(uint8_t * dest, const char * name, size_t data_length)
+{
+    memcpy(dest, name, 4);
+    write_uint32(&dest[4], (uint32_t)data_length);
+    memset(&dest[8], 0, data_length);
+    return &dest[8];
 }
 
 static
-woz_chunk * create_info_chunk()
+size_t write_info_chunk(uint8_t * dest, int cleaned, int boot_sector_format)
 {
-    woz_chunk * chunk = create_chunk("INFO", 60);
-    if (!chunk) { return NULL; }
-    write_uint8(&chunk->data[0], 2); // INFO version 2
-    write_uint8(&chunk->data[1], 1); // Disk Type (1 = 5.25)
-    write_uint8(&chunk->data[2], 0); // Write Protected
-    write_uint8(&chunk->data[3], 0); // Synchronized
-    write_uint8(&chunk->data[4], 1); // Cleaned
-    write_utf8(&chunk->data[5], CREATOR_NAME, 32);  // Creator
-    write_uint8(&chunk->data[37], 1); // Disk sides (1 for 5.25")
-    write_uint8(&chunk->data[38], 1); // Boot sector format (1 = 16-sector)
-    write_uint8(&chunk->data[39], 32); // Optimal bit timing (32 = 4 uS standard)
-    write_uint16(&chunk->data[40], 0); // Compatibile hardware (0 = unknown)
-    write_uint16(&chunk->data[42], 0); // Required RAM (0 = unknown)
-    write_uint16(&chunk->data[44], BITS_BLOCKS_PER_TRACK); // largest track in blocks
-    return chunk;
+    uint8_t * data = begin_chunk(dest, "INFO", 60);
+    write_uint8(&data[0], 2); // INFO version 2
+    write_uint8(&data[1], 1); // Disk Type (1 = 5.25)
+    write_uint8(&data[2], 0); // Write Protected
+    write_uint8(&data[3], 0); // Synchronized
+    write_uint8(&data[4], cleaned); // Cleaned
+    write_utf8(&data[5], CREATOR_NAME, 32);  // Creator
+    write_uint8(&data[37], 1); // Disk sides (1 for 5.25")
+    write_uint8(&data[38], boot_sector_format); // Boot sector format (1 = 16-sector, 0 = unknown)
+    write_uint8(&data[39], 32); // Optimal bit timing (32 = 4 uS standard)
+    write_uint16(&data[40], 0); // Compatibile hardware (0 = unknown)
+    write_uint16(&data[42], 0); // Required RAM (0 = unknown)
+    write_uint16(&data[44], BITS_BLOCKS_PER_TRACK); // largest track in blocks
+    return WOZ_INFO_CHUNK_SIZE;
 }
 
 static
-woz_chunk * create_tmap_chunk()
+size_t write_tmap_chunk(uint8_t * dest)
 {
-    woz_chunk * chunk = create_chunk("TMAP", 160);
-    if (!chunk) { return NULL; }
+    uint8_t * data = begin_chunk(dest, "TMAP", 160);
     size_t byte_index = 0;
     // We will write all bytes of this chunk; unused entries get 0xFF (not zero).
     for (int t = 0; t < 160; t++) {
@@ -233,104 +4638,133 @@ woz_chunk * create_tmap_chunk()
             switch (t % 4) {
                 case 0:
                 case 1:
-                    write_uint8(&chunk->data[byte_index++], nominal_track);
+                    write_uint8(&data[byte_index++], nominal_track);
                     break;
                 case 2:
-                    write_uint8(&chunk->data[byte_index++], 0xFF);
+                    write_uint8(&data[byte_index++], 0xFF);
                     break;
                 case 3:
-                    write_uint8(&chunk->data[byte_index++], nominal_track + 1);
+                    write_uint8(&data[byte_index++], nominal_track + 1);
                     break;
                 default:
                     break;
             }
         } else {
-            write_uint8(&chunk->data[byte_index++], 0xFF);
+            write_uint8(&data[byte_index++], 0xFF);
         }
     }
-    return chunk;
+    return WOZ_TMAP_CHUNK_SIZE;
 }
 
+// options->track_order lists the tracks in the order their BITS blocks should appear in the
+// file. Readers that page the file in lazily (e.g. over a network filesystem) reach a boot
+// prompt sooner when the tracks touched first during boot sit together up front.
+// On return, track_bits points at each track's encoded bits, indexed by track number.
 static
-woz_chunk * create_trks_chunk(uint8_t * track_data, uint32_t valid_bits_per_track)
+size_t write_trks_chunk(uint8_t * dest, const uint8_t * track_bits[], const uint8_t * source,
+                        track_filler fill_track, const dsk2woz2_options * options,
+                        uint32_t * valid_bits_per_track)
 {
-    woz_chunk * chunk = create_chunk("TRKS", (160 * 8) + (TRACKS_PER_DISK * BITS_TRACK_SIZE));
-    if (!chunk) { return NULL; }
-
-    // Write each mandatory TRK structure (8 bytes each)
-    size_t byte_index = 0;
+    uint8_t * data = begin_chunk(dest, "TRKS", (160 * 8) + (TRACKS_PER_DISK * BITS_TRACK_SIZE));
 
     // !!! starting_block is relative to the start of the file !!! This means we depend on
     // writing the chunks in a fixed order up to this point (INFO, TMAP, TRKS, ...).
     uint16_t starting_block = 3;
     for (int i = 0 ; i < TRACKS_PER_DISK; i++) {
-        write_uint16(&chunk->data[byte_index], starting_block);
+        int t = options->track_order[i];
+
+        // Write the track bits straight into place. There are always 160 tracks' worth of
+        // TRK entries, even though the vast majority are all zeroes, and the BITS always
+        // starts at offset 1280, following the TRK table.
+        uint8_t * bits = &data[1280 + (i * BITS_TRACK_SIZE)];
+        const uint64_t trace_start = trace_begin();
+        *valid_bits_per_track = fill_track(bits, source, t, options);
+        track_bits[t] = bits;
+        trace_end(trace_name_encode, trace_start, t);
+
+        // Write the mandatory TRK structure (8 bytes) for this track. The TRK table stays
+        // indexed by track number no matter where the bits themselves land.
+        size_t byte_index = t * 8;
+        write_uint16(&data[byte_index], starting_block);
         byte_index += 2;
-        write_uint16(&chunk->data[byte_index], BITS_BLOCKS_PER_TRACK);
+        write_uint16(&data[byte_index], BITS_BLOCKS_PER_TRACK);
         byte_index += 2;
-        write_uint32(&chunk->data[byte_index], valid_bits_per_track);
-        byte_index += 4;
+        write_uint32(&data[byte_index], *valid_bits_per_track);
         starting_block += BITS_BLOCKS_PER_TRACK;
     }
-    // Copy the track bits themselves. This should already be aligned and complete so
-    // just do a blind copy. There are always 160 tracks' worth of TRK entries, even though
-    // the vast majority are all zeroes, and the BITS always starts at offset 1280, following
-    // the TRK table.
-    memcpy(&chunk->data[1280], track_data, (TRACKS_PER_DISK * BITS_TRACK_SIZE));
-    return chunk;
+    return WOZ_TRKS_CHUNK_SIZE;
 }
 
 static
-woz_chunk * create_writ_chunk(uint8_t * track_data, uint32_t valid_bits_per_track)
+size_t write_writ_chunk(uint8_t * dest, const uint8_t * track_bits[], uint32_t valid_bits_per_track)
 {
-    woz_chunk * chunk = create_chunk("WRIT", TRACKS_PER_DISK * 20);
-    if (!chunk) { return NULL; }
+    uint8_t * data = begin_chunk(dest, "WRIT", TRACKS_PER_DISK * 20);
+    const uint64_t trace_start = trace_begin();
     size_t byte_index = 0;
     for (int t = 0; t < TRACKS_PER_DISK; t++) {
-        write_uint8(&chunk->data[byte_index++], t * 4); // track to write (always the x.00)
-        write_uint8(&chunk->data[byte_index++], 1);     // 1 command in the write array
-        write_uint8(&chunk->data[byte_index++], 0x00);  // no additional flags
-        byte_index++;                                   // reserved (0)
-        
-        uint8_t * track_bits = &track_data[t * BITS_TRACK_SIZE];
         size_t length_for_crc = (valid_bits_per_track + 7) / 8;
-        uint32_t crc = crc32(0, track_bits, length_for_crc);
-        write_uint32(&chunk->data[byte_index], crc);    // BITS checksum
-        byte_index += 4;
+        uint32_t crc = crc32(0, track_bits[t], length_for_crc);
         uint32_t track_leader_sync_bits = TRACK_LEADER_SYNC_COUNT * 10;
-        write_uint32(&chunk->data[byte_index], track_leader_sync_bits); // Don't rewrite the track leader
-        byte_index += 4;
-        write_uint32(&chunk->data[byte_index], valid_bits_per_track - track_leader_sync_bits);   // Bit count
-        byte_index += 4;
-        write_uint8(&chunk->data[byte_index++], 0xFF);  // Leader nibble
-        write_uint8(&chunk->data[byte_index++], 10);    // Leader nibble bit count
-        // Leader count. I'm not sure why this is 0, but mimics Applesauce save-as-WOZ output:
-        write_uint8(&chunk->data[byte_index++], 0);
-        byte_index++;                                   // padding (0)
+        // The track to write is always the x.00. Don't rewrite the track leader.
+        byte_index += write_writ_entry(&data[byte_index], t * 4, crc, track_leader_sync_bits,
+                                       valid_bits_per_track - track_leader_sync_bits);
     }
-    return chunk;
+    trace_end(trace_name_crc, trace_start, -1);
+    return WOZ_WRIT_CHUNK_SIZE;
 }
 
+// Writes a WRIT entry with a single command, writing bit_count bits from leader_bits on.
 static
-size_t total_chunk_size(woz_chunk * chunk)
+size_t write_writ_entry(uint8_t * dest, int quarter_track, uint32_t crc, uint32_t leader_bits, uint32_t bit_count)
 {
-    return 4 + 4 + chunk->data_length;
+    size_t byte_index = 0;
+    write_uint8(&dest[byte_index++], quarter_track); // track to write
+    write_uint8(&dest[byte_index++], 1);     // 1 command in the write array
+    write_uint8(&dest[byte_index++], 0x00);  // no additional flags
+    byte_index++;                            // reserved (0)
+    write_uint32(&dest[byte_index], crc);    // BITS checksum
+    byte_index += 4;
+    write_uint32(&dest[byte_index], leader_bits);   // Start bit
+    byte_index += 4;
+    write_uint32(&dest[byte_index], bit_count);     // Bit count
+    byte_index += 4;
+    write_uint8(&dest[byte_index++], 0xFF);  // Leader nibble
+    write_uint8(&dest[byte_index++], 10);    // Leader nibble bit count
+    // Leader count. I'm not sure why this is 0, but mimics Applesauce save-as-WOZ output:
+    write_uint8(&dest[byte_index++], 0);
+    byte_index++;                            // padding (0)
+    return byte_index;
+}
+
+// Finds the named chunk in a WOZ image. Returns a pointer to its data, or NULL.
+static
+const uint8_t * find_chunk(const uint8_t * woz, size_t woz_size, const char * name, uint32_t * data_length)
+{
+    size_t index = WOZ_HEADER_SIZE;
+    while (index + 8 <= woz_size) {
+        const uint32_t length = read_uint32(&woz[index + 4]);
+        if (length > woz_size - index - 8) {
+            return NULL;
+        }
+        if (memcmp(&woz[index], name, 4) == 0) {
+            *data_length = length;
+            return &woz[index + 8];
+        }
+        index += 8 + length;
+    }
+    return NULL;
 }
 
-// !! DO NOT mess up knowing how much runway remains in dest.
 static
-size_t write_chunk(uint8_t * dest, woz_chunk * chunk)
+uint16_t read_uint16(const uint8_t * src)
 {
-    write_uint32(dest, chunk->name);
-    write_uint32(&dest[4], (uint32_t)chunk->data_length);
-    memcpy(&dest[8], chunk->data, chunk->data_length);
-    return 8 + chunk->data_length;
+    return src[0] | (src[1] << 8);
 }
 
 static
-void free_chunk(woz_chunk * chunk)
+uint32_t read_uint32(const uint8_t * src)
 {
-    free(chunk);
+    return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
 }
 
 static
@@ -368,6 +4802,55 @@ void write_utf8(uint8_t * dest, const char * utf8string, int n)
     }
 }
 
+//
+// Track layout routines
+//
+
+// Fills in the options' track order from a layout spec. "boot" is the predicted access order for a
+// booting disk: track 0, then the DOS catalog track. Otherwise the spec is a comma separated
+// list of tracks, e.g. from an access profile. Either way, any tracks not mentioned follow
+// in ascending order. Returns 0 (leaving the options alone) if the spec is malformed.
+int dsk2woz2_set_track_layout(dsk2woz2_options * options, const char * spec)
+{
+    int track_order[TRACKS_PER_DISK];
+    int placed[TRACKS_PER_DISK] = { 0 };
+    int count = 0;
+
+    if (strcmp(spec, "boot") == 0) {
+        track_order[count++] = 0;
+        track_order[count++] = DOS_CATALOG_TRACK;
+        placed[0] = placed[DOS_CATALOG_TRACK] = 1;
+    } else {
+        // Every field must be a track, so an empty spec or a stray comma is malformed too.
+        const char * p = spec;
+        for (;;) {
+            char * end;
+            long t = strtol(p, &end, 10);
+            if (end == p || t < 0 || t >= TRACKS_PER_DISK || placed[t]) {
+                return 0;
+            }
+            track_order[count++] = (int)t;
+            placed[t] = 1;
+            p = end;
+            if (*p == '\0') {
+                break;
+            }
+            if (*p != ',') {
+                return 0;
+            }
+            p++;
+        }
+    }
+
+    for (int t = 0; t < TRACKS_PER_DISK; t++) {
+        if (!placed[t]) {
+            track_order[count++] = t;
+        }
+    }
+    memcpy(options->track_order, track_order, sizeof(track_order));
+    return 1;
+}
+
 //
 // Track encoding and writing routines
 //
@@ -386,6 +4869,21 @@ size_t bits_write_byte(uint8_t * buffer, size_t index, int value)
     return index + 8;
 }
 
+// Like bits_write_byte, but replaces whatever bits were there before.
+static
+size_t bits_put_byte(uint8_t * buffer, size_t index, int value)
+{
+    size_t shift = index & 7;
+    size_t byte_position = index >> 3;
+
+    buffer[byte_position] = (buffer[byte_position] & ~(0xFF >> shift)) | (value >> shift);
+    if (shift) {
+        buffer[byte_position + 1] = (buffer[byte_position + 1] & (0xFF >> shift)) | (uint8_t)(value << (8 - shift));
+    }
+    
+    return index + 8;
+}
+
 // Writes a byte in 4-and-4
 static
 size_t bits_write_4_and_4(uint8_t * buffer, size_t index, int value)
@@ -403,26 +4901,29 @@ size_t bits_write_sync(uint8_t * buffer, size_t index)
     return index + 2; // Skip two bits, i.e. leave them as 0s.
 }
 
+// Tables for the 6-and-2 encoding: the valid disk nibbles for each six-bit value, and
+// the bit swap applied to the bottom two bits of each byte.
+static const uint8_t six_and_two_mapping[] = {
+    0x96, 0x97, 0x9a, 0x9b, 0x9d, 0x9e, 0x9f, 0xa6,
+    0xa7, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb2, 0xb3,
+    0xb4, 0xb5, 0xb6, 0xb7, 0xb9, 0xba, 0xbb, 0xbc,
+    0xbd, 0xbe, 0xbf, 0xcb, 0xcd, 0xce, 0xcf, 0xd3,
+    0xd6, 0xd7, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde,
+    0xdf, 0xe5, 0xe6, 0xe7, 0xe9, 0xea, 0xeb, 0xec,
+    0xed, 0xee, 0xef, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6,
+    0xf7, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
+static const uint8_t bit_reverse[] = {0, 2, 1, 3};
+
 // Encodes a 256-byte sector buffer into a 343 byte 6-and-2 encoding of same
 static
 void encode_6_and_2(uint8_t * dest, const uint8_t * src)
 {
-    const uint8_t six_and_two_mapping[] = {
-        0x96, 0x97, 0x9a, 0x9b, 0x9d, 0x9e, 0x9f, 0xa6,
-        0xa7, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb2, 0xb3,
-        0xb4, 0xb5, 0xb6, 0xb7, 0xb9, 0xba, 0xbb, 0xbc,
-        0xbd, 0xbe, 0xbf, 0xcb, 0xcd, 0xce, 0xcf, 0xd3,
-        0xd6, 0xd7, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde,
-        0xdf, 0xe5, 0xe6, 0xe7, 0xe9, 0xea, 0xeb, 0xec,
-        0xed, 0xee, 0xef, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6,
-        0xf7, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
-    };
-
     // Fill in byte values: the first 86 bytes contain shuffled
     // and combined copies of the bottom two bits of the sector
     // contents; the 256 bytes afterwards are the remaining
     // six bits.
-    const uint8_t bit_reverse[] = {0, 2, 1, 3};
     for (int c = 0; c < 84; c++) {
         dest[c] =
             bit_reverse[src[c] & 3] |
@@ -454,8 +4955,22 @@ void encode_6_and_2(uint8_t * dest, const uint8_t * src)
     }
 }
 
+// Figures out which logical sector goes into a physical sector.
+static
+int logical_sector_for_physical(int physical_sector, dsk2woz2_sector_format sector_format)
+{
+    if (physical_sector == 0x0F) {
+        return 0x0F;
+    }
+    int multiplier = (sector_format == dsk2woz2_sector_format_prodos) ? 8 : 7;
+    return (physical_sector * multiplier) % 15;
+}
+
+// If data_bit_offsets isn't NULL, it receives the bit index at which each physical sector's
+// encoded contents begin.
 static
-size_t encode_bits_for_track(uint8_t * dest, uint8_t * src, int track_number, dsk_sector_format sector_format)
+size_t encode_bits_for_track(uint8_t * dest, const uint8_t * src, int track_number, dsk2woz2_sector_format sector_format,
+                             uint32_t * data_bit_offsets)
 {
     size_t bit_index = 0;
     memset(dest, 0, BITS_TRACK_SIZE);
@@ -503,18 +5018,13 @@ size_t encode_bits_for_track(uint8_t * dest, uint8_t * src, int track_number, ds
         bit_index = bits_write_byte(dest, bit_index, 0xAA);
         bit_index = bits_write_byte(dest, bit_index, 0xAD);
 
-        // Figure out which logical sector goes into this physical sector.
-        int logical_sector;
-        if (s == 0x0F) {
-            logical_sector = 0x0F;
-        } else {
-            int multiplier = (sector_format == dsk_sector_format_prodos) ? 8 : 7;
-            logical_sector = (s * multiplier) % 15;
-        }
-
         // Finally, the actual contents! Encode the buffer, then write them.
+        int logical_sector = logical_sector_for_physical(s, sector_format);
         uint8_t encoded_contents[BITS_SECTOR_CONTENTS_SIZE];
         encode_6_and_2(encoded_contents, &src[logical_sector * BYTES_PER_SECTOR]);
+        if (data_bit_offsets) {
+            data_bit_offsets[s] = (uint32_t)bit_index;
+        }
         for (int i = 0; i < BITS_SECTOR_CONTENTS_SIZE; i++) {
             bit_index = bits_write_byte(dest, bit_index, encoded_contents[i]);
         }
@@ -548,7 +5058,7 @@ size_t encode_bits_for_track(uint8_t * dest, uint8_t * src, int track_number, ds
 // Copied from https://applesaucefdc.com/woz/reference2/
 //
 
-static uint32_t crc32_tab[] = {
+static const uint32_t crc32_tab[] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
     0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
     0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
@@ -604,3 +5114,63 @@ uint32_t crc32(uint32_t crc, const void *buf, size_t size)
     crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
     return crc ^ ~0U;
 }
+
+// The CRC register is a polynomial over GF(2), stored bit-reversed like the table above, so
+// running it over zeros is a multiplication by a power of x. These let CRCs of separately
+// checksummed pieces be stitched together without going over the bytes again.
+
+static
+uint32_t crc32_multiply(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (uint32_t m = 1U << 31; m != 0; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+        }
+        b = (b & 1) ? (b >> 1) ^ 0xEDB88320 : (b >> 1);
+    }
+    return product;
+}
+
+// Returns the raw register (no pre- or post-conditioning) after running length zero bytes
+// through it.
+static
+uint32_t crc32_shift(uint32_t crc, size_t length)
+{
+    uint32_t power = 1U << 23;      // x^8, i.e. one byte
+    while (length != 0) {
+        if (length & 1) {
+            crc = crc32_multiply(power, crc);
+        }
+        power = crc32_multiply(power, power);
+        length >>= 1;
+    }
+    return crc;
+}
+
+// Returns the CRC of A followed by B, from the CRCs of each.
+static
+uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, size_t length_b)
+{
+    return crc_b ^ crc32_shift(crc_a, length_b);
+}
+
+// Returns the CRC of A followed by length zero bytes, from the CRC of A.
+static
+uint32_t crc32_extend_zeros(uint32_t crc, size_t length)
+{
+    return ~crc32_shift(~crc, length);
+}
+
+// Returns a message's new CRC after length bytes, followed by bytes_after more, change from
+// old_bytes to new_bytes. The CRC is linear, so only the difference matters.
+static
+uint32_t crc32_patch(uint32_t crc, const uint8_t * old_bytes, const uint8_t * new_bytes, size_t length,
+                     size_t bytes_after)
+{
+    uint32_t difference = 0;    // The raw register, run from zero over old ^ new
+    for (size_t i = 0; i < length; i++) {
+        difference = crc32_tab[(difference ^ old_bytes[i] ^ new_bytes[i]) & 0xFF] ^ (difference >> 8);
+    }
+    return crc ^ crc32_shift(difference, bytes_after);
+}
@@ -0,0 +1,214 @@
+//
+//  dsk2woz2.h
+//
+//  By Ben Zotto. Copyright (c) 2021.
+//
+//  The dsk2woz2 conversion routines, for calling from other programs (C or C++). Compile
+//  dsk2woz2.c with DSK2WOZ2_NO_MAIN defined to leave out the command line utility.
+//
+
+#ifndef DSK2WOZ2_H
+#define DSK2WOZ2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DSK2WOZ2_TRACKS_PER_DISK            35
+#define DSK2WOZ2_SECTORS_PER_TRACK          16
+#define DSK2WOZ2_BYTES_PER_SECTOR           256
+#define DSK2WOZ2_BYTES_PER_TRACK            (DSK2WOZ2_SECTORS_PER_TRACK * DSK2WOZ2_BYTES_PER_SECTOR)
+#define DSK2WOZ2_DSK_IMAGE_SIZE             (DSK2WOZ2_TRACKS_PER_DISK * DSK2WOZ2_BYTES_PER_TRACK)
+#define DSK2WOZ2_NIB_TRACK_SIZE             6656
+#define DSK2WOZ2_NIB_IMAGE_SIZE             (DSK2WOZ2_TRACKS_PER_DISK * DSK2WOZ2_NIB_TRACK_SIZE)
+
+#define DSK2WOZ2_BITS_BLOCKS_PER_TRACK      13
+#define DSK2WOZ2_BITS_BLOCK_SIZE            512
+#define DSK2WOZ2_BITS_TRACK_SIZE            (DSK2WOZ2_BITS_BLOCKS_PER_TRACK * DSK2WOZ2_BITS_BLOCK_SIZE)
+#define DSK2WOZ2_WOZ_HEADER_SIZE            12
+
+typedef enum _dsk2woz2_sector_format {
+    dsk2woz2_sector_format_dos_3_3 = 0,
+    dsk2woz2_sector_format_prodos = 1
+} dsk2woz2_sector_format;
+
+//
+// Conversion API. The whole conversion runs out of the caller's buffers, with no
+// allocation and no intermediate copies, so that it can be embedded in other programs.
+//
+
+#define DSK2WOZ2_WOZ_INFO_CHUNK_SIZE        (8 + 60)
+#define DSK2WOZ2_WOZ_TMAP_CHUNK_SIZE        (8 + 160)
+#define DSK2WOZ2_WOZ_TRKS_CHUNK_SIZE        (8 + (160 * 8) + (DSK2WOZ2_TRACKS_PER_DISK * DSK2WOZ2_BITS_TRACK_SIZE))
+#define DSK2WOZ2_WOZ_WRIT_CHUNK_SIZE        (8 + (DSK2WOZ2_TRACKS_PER_DISK * 20))
+#define DSK2WOZ2_WOZ_IMAGE_SIZE             (DSK2WOZ2_WOZ_HEADER_SIZE + DSK2WOZ2_WOZ_INFO_CHUNK_SIZE + \
+                                             DSK2WOZ2_WOZ_TMAP_CHUNK_SIZE + DSK2WOZ2_WOZ_TRKS_CHUNK_SIZE + \
+                                             DSK2WOZ2_WOZ_WRIT_CHUNK_SIZE)
+
+typedef struct _dsk2woz2_options {
+    dsk2woz2_sector_format sector_format;
+    int track_order[DSK2WOZ2_TRACKS_PER_DISK];  // Order of the BITS blocks in the file, by track
+} dsk2woz2_options;
+
+void dsk2woz2_default_options(dsk2woz2_options * options);
+int dsk2woz2_set_track_layout(dsk2woz2_options * options, const char * spec);
+size_t dsk2woz2_convert(uint8_t * woz, size_t woz_capacity,
+                        const uint8_t * dsk, size_t dsk_size,
+                        const dsk2woz2_options * options);
+size_t dsk2woz2_convert_nib(uint8_t * woz, size_t woz_capacity,
+                            const uint8_t * nib, size_t nib_size,
+                            const dsk2woz2_options * options);
+
+//
+// Input format detection. Probing looks only at the magic numbers, size and a few header
+// or directory bytes of an image already in memory (typically mapped straight from its file),
+// so it's cheap enough to run on every file in a batch, whatever its extension says.
+//
+
+typedef enum _dsk2woz2_format {
+    dsk2woz2_format_unknown = 0,
+    dsk2woz2_format_dsk,            // 16-sector sectors (.dsk, .do, .po, or inside a .2mg)
+    dsk2woz2_format_nib,            // 6656 nibbles per track (.nib, or inside a .2mg)
+    dsk2woz2_format_woz1,
+    dsk2woz2_format_woz2,
+    dsk2woz2_format_gzip,
+    dsk2woz2_format_zip
+} dsk2woz2_format;
+
+typedef struct _dsk2woz2_probe {
+    dsk2woz2_format format;
+    dsk2woz2_sector_format sector_format;   // For dsk2woz2_format_dsk
+    size_t offset;                          // Where the disk data starts within the image
+    size_t size;                            // How much disk data there is
+} dsk2woz2_probe;
+
+int dsk2woz2_probe_image(dsk2woz2_probe * probe, const uint8_t * image, size_t image_size, const char * name);
+size_t dsk2woz2_convert_image(uint8_t * woz, size_t woz_capacity, const uint8_t * image,
+                              const dsk2woz2_probe * probe, const dsk2woz2_options * options);
+size_t dsk2woz2_woz_capacity_for_image(const uint8_t * image, const dsk2woz2_probe * probe);
+const char * dsk2woz2_format_name(dsk2woz2_format format);
+
+//
+// Asynchronous conversion API. Requests are submitted to a pool of worker threads and
+// harvested from a completion queue. The queue's file descriptor becomes readable whenever
+// completions are waiting, so it can sit in an epoll/poll/select loop next to sockets.
+// Requests (and the buffers they point to) belong to the caller and must stay put until
+// they have been reaped.
+//
+
+typedef struct _dsk2woz2_request {
+    const uint8_t * image;
+    dsk2woz2_probe probe;                   // As filled in by dsk2woz2_probe_image
+    uint8_t * woz;
+    size_t woz_capacity;
+    dsk2woz2_options options;
+    void * user_tag;
+    const char * name;                      // Optional label for the image in traces
+    size_t woz_size;                        // Set on completion; 0 if the conversion failed
+    struct _dsk2woz2_request * next;        // Private to the queue
+} dsk2woz2_request;
+
+typedef struct _dsk2woz2_queue dsk2woz2_queue;
+
+dsk2woz2_queue * dsk2woz2_queue_create(int worker_count);
+int dsk2woz2_queue_fd(dsk2woz2_queue * queue);
+void dsk2woz2_queue_submit(dsk2woz2_queue * queue, dsk2woz2_request * requests[], int count);
+int dsk2woz2_queue_reap(dsk2woz2_queue * queue, dsk2woz2_request * completed[], int max_count, int wait);
+void dsk2woz2_queue_destroy(dsk2woz2_queue * queue);
+
+//
+// Compact resident disks, for hosts that keep thousands of disks in memory at once. Almost
+// all of every track is fixed sync and address structure, so a compact disk holds only its
+// 256-byte sectors (all-zero sectors take no space at all) and shares one skeleton of the
+// fixed structure with every other disk. Bits are materialized on demand, a window at a time.
+//
+
+typedef struct _dsk2woz2_skeleton {
+    uint8_t bits[DSK2WOZ2_TRACKS_PER_DISK][DSK2WOZ2_BITS_TRACK_SIZE];   // Tracks with every sector zeroed
+    uint32_t data_bit_offsets[DSK2WOZ2_SECTORS_PER_TRACK];              // Where each physical sector's data starts
+    uint32_t valid_bits_per_track;
+} dsk2woz2_skeleton;
+
+typedef struct _dsk2woz2_compact_disk dsk2woz2_compact_disk;
+
+const dsk2woz2_skeleton * dsk2woz2_shared_skeleton(void);
+dsk2woz2_compact_disk * dsk2woz2_compact_create(const uint8_t * dsk, size_t dsk_size, dsk2woz2_sector_format sector_format);
+void dsk2woz2_compact_free(dsk2woz2_compact_disk * disk);
+size_t dsk2woz2_compact_read_bits(const dsk2woz2_compact_disk * disk, int track,
+                                  uint32_t bit_index, uint32_t bit_count, uint8_t * dest);
+
+//
+// Mastering, for production runs of one disk with a few bytes (a serial number, say) changed
+// in every copy. The base image is encoded once; each variant then re-encodes just the
+// sectors its patches touch, and patches the WRIT and header CRCs to match.
+//
+
+typedef struct _dsk2woz2_patch {
+    size_t offset;                  // Into the DSK image, as stored in its file
+    const uint8_t * data;
+    size_t length;
+} dsk2woz2_patch;
+
+typedef struct _dsk2woz2_master dsk2woz2_master;
+
+dsk2woz2_master * dsk2woz2_master_create(const uint8_t * dsk, size_t dsk_size, const dsk2woz2_options * options);
+const uint8_t * dsk2woz2_master_variant(dsk2woz2_master * master, const dsk2woz2_patch patches[], int patch_count,
+                                        size_t * woz_size);
+void dsk2woz2_master_free(dsk2woz2_master * master);
+
+//
+// HFE output, for HxC and Gotek floppy emulators. The HFE tracks are made straight from a
+// WOZ image's BITS, so producing both costs a single encode.
+//
+
+#define DSK2WOZ2_HFE_BLOCK_SIZE             512
+#define DSK2WOZ2_HFE_BIT_RATE               250     // kbit/s, i.e. 2 uS cells: two per 4 uS Apple bit
+#define DSK2WOZ2_HFE_RPM                    300
+#define DSK2WOZ2_HFE_EMPTY_TRACK_BITS       50000   // One revolution of 4 uS bits at 300 RPM
+
+size_t dsk2woz2_woz_to_hfe(uint8_t * hfe, size_t hfe_capacity, const uint8_t * woz, size_t woz_size);
+
+//
+// WOZ1 upgrade. The bitstreams in a WOZ1 image are already right, so its track records are
+// block copied into WOZ2 BITS blocks rather than decoded and encoded again.
+//
+
+size_t dsk2woz2_upgrade_woz1(uint8_t * woz, size_t woz_capacity, const uint8_t * woz1, size_t woz1_size);
+
+//
+// INFO editing. Patches the INFO chunk of an existing WOZ2 image (typically mapped from its
+// file) and brings the header CRC up to date from just the bytes that changed, so the rest
+// of the image is never read.
+//
+
+typedef struct _dsk2woz2_info_edit {
+    int write_protected;            // 0 or 1, or -1 to leave alone
+    int compatible_hardware;        // Bit field, or -1 to leave alone
+    int required_ram;               // In KB, or -1 to leave alone
+    const char * creator;           // Up to 32 bytes of UTF-8, or NULL to leave alone
+} dsk2woz2_info_edit;
+
+void dsk2woz2_default_info_edit(dsk2woz2_info_edit * edit);
+int dsk2woz2_edit_info(uint8_t * woz, size_t woz_size, const dsk2woz2_info_edit * edit);
+
+// Checks a WOZ2 image's header CRC (unless it's 0, i.e. not calculated) and the BITS CRC in
+// every WRIT entry. Returns 1 if they all match.
+int dsk2woz2_verify_woz(const uint8_t * woz, size_t woz_size);
+
+//
+// Tracing. Once started, conversions record what each thread is doing and when into
+// per-thread buffers, which are written out at the end as a Chrome trace (JSON) timeline
+// that chrome://tracing or Perfetto can open.
+//
+
+void dsk2woz2_trace_start(void);
+int dsk2woz2_trace_write(const char * path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DSK2WOZ2_H
@@ -0,0 +1,207 @@
+//
+//  dsk2woz2.hpp
+//
+//  By Ben Zotto. Copyright (c) 2021.
+//
+//  A C++20 face on the dsk2woz2 conversion routines: images go in and come out as spans of
+//  std::byte, straight from and into the caller's buffers, and the sector order and track
+//  layout are template parameters, checked at compile time. Link with dsk2woz2.c compiled
+//  with DSK2WOZ2_NO_MAIN defined.
+//
+//  The encoder itself stays in C, so the geometry isn't a parameter: a 35-track, 16-sector
+//  5.25" disk is all it writes, and the constants below are the only sizes there are. The
+//  encoding tables are here as constexpr for code that wants to check or decode bits itself.
+//  The track skeleton isn't, being 230 KB; dsk2woz2::skeleton() is built once, on first use.
+//
+
+#ifndef DSK2WOZ2_HPP
+#define DSK2WOZ2_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include "dsk2woz2.h"
+
+namespace dsk2woz2 {
+
+inline constexpr std::size_t tracks_per_disk = DSK2WOZ2_TRACKS_PER_DISK;
+inline constexpr std::size_t sectors_per_track = DSK2WOZ2_SECTORS_PER_TRACK;
+inline constexpr std::size_t bytes_per_sector = DSK2WOZ2_BYTES_PER_SECTOR;
+inline constexpr std::size_t dsk_image_size = DSK2WOZ2_DSK_IMAGE_SIZE;
+inline constexpr std::size_t nib_image_size = DSK2WOZ2_NIB_IMAGE_SIZE;
+inline constexpr std::size_t bits_track_size = DSK2WOZ2_BITS_TRACK_SIZE;
+inline constexpr std::size_t woz_image_size = DSK2WOZ2_WOZ_IMAGE_SIZE;
+
+enum class sector_format {
+    dos_3_3 = dsk2woz2_sector_format_dos_3_3,
+    prodos = dsk2woz2_sector_format_prodos
+};
+
+// Where each track's BITS blocks go in the file, by track; see dsk2woz2_set_track_layout.
+using track_order = std::array<int, tracks_per_disk>;
+
+constexpr track_order sequential_tracks()
+{
+    track_order order {};
+    for (std::size_t t = 0; t < tracks_per_disk; t++) {
+        order[t] = static_cast<int>(t);
+    }
+    return order;
+}
+
+// Every track must appear in the order exactly once.
+constexpr bool is_valid(const track_order & order)
+{
+    std::array<bool, tracks_per_disk> seen {};
+    for (int track : order) {
+        if (track < 0 || track >= static_cast<int>(tracks_per_disk) || seen[track]) {
+            return false;
+        }
+        seen[track] = true;
+    }
+    return true;
+}
+
+//
+// Encoding tables, generated rather than typed in.
+//
+
+// The 6-and-2 disk nibbles, in order: bytes with the top bit set, at least one pair of
+// adjacent 1s below it, and no more than one pair of adjacent 0s, less the reserved 0xAA
+// and 0xD5 that the address and data marks begin with.
+constexpr std::array<std::uint8_t, 64> make_six_and_two_mapping()
+{
+    std::array<std::uint8_t, 64> mapping {};
+    std::size_t count = 0;
+    for (unsigned value = 0x80; value <= 0xff; value++) {
+        bool adjacent_ones = false;
+        int adjacent_zero_pairs = 0;
+        for (int bit = 0; bit < 6; bit++) {
+            const unsigned pair = (value >> bit) & 3;
+            adjacent_ones |= (pair == 3);
+            adjacent_zero_pairs += (pair == 0);
+        }
+        if (adjacent_ones && adjacent_zero_pairs <= 1 && value != 0xaa && value != 0xd5) {
+            mapping[count++] = static_cast<std::uint8_t>(value);
+        }
+    }
+    return mapping;
+}
+
+inline constexpr std::array<std::uint8_t, 64> six_and_two_mapping = make_six_and_two_mapping();
+static_assert(six_and_two_mapping[0] == 0x96 && six_and_two_mapping[63] == 0xff);
+
+// The swap applied to the bottom two bits of each byte in the 6-and-2 auxiliary buffer.
+inline constexpr std::array<std::uint8_t, 4> bit_reverse = { 0, 2, 1, 3 };
+
+// The CRC-32 used throughout WOZ files (the zlib one, polynomial 0xEDB88320).
+constexpr std::array<std::uint32_t, 256> make_crc32_table()
+{
+    std::array<std::uint32_t, 256> table {};
+    for (std::uint32_t i = 0; i < 256; i++) {
+        std::uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (0xedb88320 ^ (crc >> 1)) : (crc >> 1);
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+inline constexpr std::array<std::uint32_t, 256> crc32_table = make_crc32_table();
+
+constexpr std::uint32_t crc32(std::uint32_t crc, std::span<const std::byte> data)
+{
+    crc = ~crc;
+    for (std::byte b : data) {
+        crc = crc32_table[(crc ^ static_cast<std::uint8_t>(b)) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+//
+// Conversion. Each returns the part of the output span that was written, which is empty if
+// the input was the wrong size or the output too small.
+//
+
+namespace detail {
+
+template <sector_format Format, track_order Order>
+constexpr dsk2woz2_options options()
+{
+    dsk2woz2_options options {};
+    options.sector_format = static_cast<dsk2woz2_sector_format>(Format);
+    for (std::size_t t = 0; t < tracks_per_disk; t++) {
+        options.track_order[t] = Order[t];
+    }
+    return options;
+}
+
+inline std::uint8_t * bytes(std::span<std::byte> span)
+{
+    return reinterpret_cast<std::uint8_t *>(span.data());
+}
+
+inline const std::uint8_t * bytes(std::span<const std::byte> span)
+{
+    return reinterpret_cast<const std::uint8_t *>(span.data());
+}
+
+// An empty output span has no data, which the C functions take as asking for the size.
+inline std::span<std::byte> written(std::span<std::byte> output, std::size_t size)
+{
+    return (output.data() && size <= output.size()) ? output.first(size) : std::span<std::byte>();
+}
+
+} // namespace detail
+
+template <sector_format Format = sector_format::dos_3_3, track_order Order = sequential_tracks()>
+std::span<std::byte> convert(std::span<std::byte> woz, std::span<const std::byte> dsk)
+{
+    static_assert(is_valid(Order), "every track must appear in the track order exactly once");
+    static constexpr dsk2woz2_options options = detail::options<Format, Order>();
+    return detail::written(woz, dsk2woz2_convert(detail::bytes(woz), woz.size(), detail::bytes(dsk), dsk.size(), &options));
+}
+
+template <track_order Order = sequential_tracks()>
+std::span<std::byte> convert_nib(std::span<std::byte> woz, std::span<const std::byte> nib)
+{
+    static_assert(is_valid(Order), "every track must appear in the track order exactly once");
+    static constexpr dsk2woz2_options options = detail::options<sector_format::dos_3_3, Order>();
+    return detail::written(woz, dsk2woz2_convert_nib(detail::bytes(woz), woz.size(), detail::bytes(nib), nib.size(), &options));
+}
+
+// Converts whatever dsk2woz2_probe_image makes of the image, with the sector order it found.
+// Size the output with dsk2woz2_woz_capacity_for_image.
+template <track_order Order = sequential_tracks()>
+std::span<std::byte> convert_image(std::span<std::byte> woz, std::span<const std::byte> image,
+                                   const dsk2woz2_probe & probe)
+{
+    static_assert(is_valid(Order), "every track must appear in the track order exactly once");
+    static constexpr dsk2woz2_options options = detail::options<sector_format::dos_3_3, Order>();
+    if (probe.offset > image.size() || probe.size > image.size() - probe.offset) {
+        return {};
+    }
+    return detail::written(woz, dsk2woz2_convert_image(detail::bytes(woz), woz.size(), detail::bytes(image), &probe, &options));
+}
+
+inline std::span<std::byte> to_hfe(std::span<std::byte> hfe, std::span<const std::byte> woz)
+{
+    return detail::written(hfe, dsk2woz2_woz_to_hfe(detail::bytes(hfe), hfe.size(), detail::bytes(woz), woz.size()));
+}
+
+inline bool verify(std::span<const std::byte> woz)
+{
+    return dsk2woz2_verify_woz(detail::bytes(woz), woz.size()) != 0;
+}
+
+inline const dsk2woz2_skeleton * skeleton()
+{
+    return dsk2woz2_shared_skeleton();
+}
+
+} // namespace dsk2woz2
+
+#endif // DSK2WOZ2_HPP